@@ -0,0 +1,126 @@
+/*
+ * Alias method (Vose) sampling tables for successor distributions.
+ */
+
+#ifndef ALIASSAMPLER_H
+#define ALIASSAMPLER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/***
+ * Holds one alias table per distribution, drawing takes one random number
+ * and one table entry read regardless of the number of successors.
+ * Each bucket keeps its own symbol with probability threshold / 2^32,
+ * otherwise its alias.
+ */
+class AliasSampler
+{
+public:
+	/**
+	 * Append a table for the counts in packed (total count followed by the
+	 * counts of the set mask bits, see SparseCounts). Returns the reference
+	 * to pass to sample(), 0 for an empty mask.
+	 */
+	template <typename T>
+	uint64_t add(uint32_t mask, const T* packed);
+
+	/// draw a symbol from the table ref using a uniform random word, 255 for ref 0
+	inline unsigned char sample(uint64_t ref, uint64_t rand64) const
+	{
+		const size_t count = ref & 63;
+		if (count == 0)
+			return 255;
+
+		// bucket from the high, fraction from the low half of the product
+		const unsigned __int128 scaled = (unsigned __int128)rand64 * count;
+		const size_t   bucket = scaled >> 64;
+		const Entry&   entry  = entries[(ref >> 6) + bucket];
+		const uint32_t frac   = uint64_t(scaled) >> 32;
+		return frac < entry.threshold ? entry.symbol : entry.alias;
+	};
+
+	struct Entry
+	{
+		uint32_t      threshold;
+		unsigned char symbol;
+		unsigned char alias;
+	};
+
+	void         clear() { std::vector<Entry>().swap(entries); };  ///< drop all tables and release their memory
+	uint64_t     bytes() const { return entries.capacity()*sizeof(Entry); };
+	size_t       size() const { return entries.size(); };
+	const Entry& entry(size_t idx) const { return entries[idx]; }; ///< tables of ref start at index ref >> 6
+
+private:
+	std::vector<Entry> entries;
+};
+
+
+
+
+template <typename T>
+uint64_t AliasSampler::
+add(uint32_t mask, const T* packed)
+{
+	const size_t count = __builtin_popcount(mask);
+	if (count == 0)
+		return 0;
+
+	const uint64_t start = entries.size();
+	entries.resize(start + count);
+	Entry* table = &entries[start];
+
+	// weights scaled by count, so a bucket holds exactly total (128 bits, count*total may not fit 64)
+	const uint64_t total = packed[0];
+	unsigned __int128 weight[32];
+	size_t small[32], large[32];
+	size_t smallCount = 0, largeCount = 0;
+	size_t idx = 0;
+	for (uint32_t m = mask; m; m &= m-1, ++idx)
+	{
+		table[idx].symbol = __builtin_ctz(m);
+		table[idx].alias  = table[idx].symbol;
+		weight[idx] = (unsigned __int128)packed[idx+1] * count;
+		if (weight[idx] < total)
+			small[smallCount++] = idx;
+		else
+			large[largeCount++] = idx;
+	}
+
+	while (smallCount > 0 && largeCount > 0)
+	{
+		const size_t less = small[--smallCount];
+		const size_t more = large[largeCount-1];
+		table[less].threshold = uint32_t((weight[less] << 32) / total);  // weight < total, so below 2^32
+		table[less].alias     = table[more].symbol;
+
+		weight[more] -= total - weight[less];
+		if (weight[more] < total)
+		{
+			--largeCount;
+			small[smallCount++] = more;
+		}
+	}
+
+	// remaining buckets (and rounding leftovers) always keep their symbol
+	while (largeCount > 0)
+	{
+		Entry& entry = table[large[--largeCount]];
+		entry.threshold = 4294967295u;
+		entry.alias     = entry.symbol;
+	}
+	while (smallCount > 0)
+	{
+		Entry& entry = table[small[--smallCount]];
+		entry.threshold = 4294967295u;
+		entry.alias     = entry.symbol;
+	}
+
+	return (start << 6) | count;
+}
+
+
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ * Block text to symbol encoder: lookup table translation, removal of
+ * unused characters and of repeated whitespace.
+ *
+ * Vectorized with AVX2 or SSSE3 when the compiler targets them
+ * (e.g. -march=native), scalar otherwise. encodeBlock is the widest
+ * version available, encodeBlockAVX2 and encodeBlockSSSE3 are defined
+ * whenever the target has them (see test/encodeblocktest.cpp).
+ */
+
+#ifndef ENCODEBLOCK_H
+#define ENCODEBLOCK_H
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+
+/**
+ * Reference implementation.
+ * Translates inLen bytes through codeLUT into out, dropping codes >= symbols
+ * and whitespace (code 0) following whitespace. WSlast carries the whitespace
+ * state between calls. Returns number of symbols written (at most inLen),
+ * out must hold inLen bytes.
+ */
+inline size_t encodeBlockScalar(const unsigned char* in, size_t inLen, unsigned char* out,
+                                const unsigned char codeLUT[256], unsigned char symbols, bool& WSlast)
+{
+	unsigned char* outIt = out;
+	for (size_t ii = 0; ii < inLen; ++ii)
+	{
+		const unsigned char enc = codeLUT[in[ii]];
+		if((enc != 0 || !WSlast) && enc < symbols)
+		{
+			WSlast = enc == 0;
+			*outIt++ = enc;
+		}
+	}
+	return outIt - out;
+}
+
+
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+
+/**
+ * Shuffle controls for packing the bytes selected by an 8 bit mask to the
+ * front of an 8 byte group.
+ */
+class CompactTable
+{
+public:
+	CompactTable()
+	{
+		for (unsigned int mask = 0; mask < 256; ++mask)
+		{
+			unsigned char idx[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+			unsigned int count = 0;
+			for (unsigned int bit = 0; bit < 8; ++bit)
+				if (mask & (1u << bit))
+					idx[count++] = bit;
+
+			uint64_t ctrl = 0;
+			for (unsigned int ii = 0; ii < 8; ++ii)
+				ctrl |= uint64_t(idx[ii]) << (8*ii);
+			shuffle[mask] = ctrl;
+			popcnt[mask] = count;
+		}
+	}
+
+	uint64_t      shuffle[256];
+	unsigned char popcnt[256];
+
+	static const CompactTable& get()
+	{
+		static const CompactTable table;
+		return table;
+	}
+};
+
+
+
+/// write the bytes of v selected by the 16 bit mask to out, returns byte count.
+/// Up to 16 bytes at out may be written.
+inline size_t compactStore(__m128i v, unsigned int mask, unsigned char* out, const CompactTable& tbl)
+{
+	const unsigned int mlo = mask & 0xff;
+	const unsigned int mhi = mask >> 8;
+	const __m128i ctrl = _mm_add_epi8(
+		_mm_set_epi64x(tbl.shuffle[mhi], tbl.shuffle[mlo]),
+		_mm_set_epi64x(0x0808080808080808LL, 0));
+	const __m128i packed = _mm_shuffle_epi8(v, ctrl);
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(out), packed);
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(out + tbl.popcnt[mlo]), _mm_unpackhi_epi64(packed, packed));
+	return tbl.popcnt[mlo] + tbl.popcnt[mhi];
+}
+
+#endif
+
+
+
+#if defined(__AVX2__)
+
+/**
+ * AVX2 implementation of encodeBlockScalar.
+ * The 256 entry table is looked up as 16 rows of 16 (one pshufb per row).
+ * Vectors with codes >= symbols are rare and handed to the scalar path.
+ */
+inline size_t encodeBlockAVX2(const unsigned char* in, size_t inLen, unsigned char* out,
+                              const unsigned char codeLUT[256], unsigned char symbols, bool& WSlast)
+{
+	const CompactTable& tbl = CompactTable::get();
+
+	__m256i rows[16];
+	for (unsigned int row = 0; row < 16; ++row)
+		rows[row] = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(codeLUT + 16*row)));
+
+	const __m256i zero      = _mm256_setzero_si256();
+	const __m256i rowStep   = _mm256_set1_epi8(0x10);
+	const __m256i idxOffset = _mm256_set1_epi8(0x70);
+	const __m256i limit     = _mm256_set1_epi8(symbols);
+
+	unsigned char* outIt = out;
+	size_t ii = 0;
+	for (; ii + 32 <= inLen; ii += 32)
+	{
+		const __m256i raw = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + ii));
+
+		// raw - 16*row is 0-15 on the matching row, others saturate to >= 0x80 (pshufb gives 0)
+		__m256i enc = zero;
+		__m256i sel = raw;
+		for (unsigned int row = 0; row < 16; ++row)
+		{
+			enc = _mm256_or_si256(enc, _mm256_shuffle_epi8(rows[row], _mm256_adds_epu8(sel, idxOffset)));
+			sel = _mm256_sub_epi8(sel, rowStep);
+		}
+
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(enc, limit), enc)))
+		{
+			outIt += encodeBlockScalar(in + ii, 32, outIt, codeLUT, symbols, WSlast);
+			continue;
+		}
+
+		// whitespace preceded by whitespace is dropped
+		const __m256i ws     = _mm256_cmpeq_epi8(enc, zero);
+		const __m256i carry  = _mm256_set_epi8(WSlast ? -1 : 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		                                       0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+		const __m256i prevWs = _mm256_alignr_epi8(ws, _mm256_permute2x128_si256(ws, carry, 0x03), 15);
+		const unsigned int keep = ~static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_and_si256(ws, prevWs)));
+
+		outIt += compactStore(_mm256_castsi256_si128(enc), keep & 0xffff, outIt, tbl);
+		outIt += compactStore(_mm256_extracti128_si256(enc, 1), keep >> 16, outIt, tbl);
+		WSlast = codeLUT[in[ii+31]] == 0;
+	}
+
+	return (outIt - out) + encodeBlockScalar(in + ii, inLen - ii, outIt, codeLUT, symbols, WSlast);
+}
+
+#endif
+
+
+
+#if defined(__SSSE3__)
+
+/**
+ * SSSE3 implementation of encodeBlockScalar, see the AVX2 version.
+ */
+inline size_t encodeBlockSSSE3(const unsigned char* in, size_t inLen, unsigned char* out,
+                               const unsigned char codeLUT[256], unsigned char symbols, bool& WSlast)
+{
+	const CompactTable& tbl = CompactTable::get();
+
+	__m128i rows[16];
+	for (unsigned int row = 0; row < 16; ++row)
+		rows[row] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(codeLUT + 16*row));
+
+	const __m128i zero      = _mm_setzero_si128();
+	const __m128i rowStep   = _mm_set1_epi8(0x10);
+	const __m128i idxOffset = _mm_set1_epi8(0x70);
+	const __m128i limit     = _mm_set1_epi8(symbols);
+
+	unsigned char* outIt = out;
+	size_t ii = 0;
+	for (; ii + 16 <= inLen; ii += 16)
+	{
+		const __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + ii));
+
+		__m128i enc = zero;
+		__m128i sel = raw;
+		for (unsigned int row = 0; row < 16; ++row)
+		{
+			enc = _mm_or_si128(enc, _mm_shuffle_epi8(rows[row], _mm_adds_epu8(sel, idxOffset)));
+			sel = _mm_sub_epi8(sel, rowStep);
+		}
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(enc, limit), enc)))
+		{
+			outIt += encodeBlockScalar(in + ii, 16, outIt, codeLUT, symbols, WSlast);
+			continue;
+		}
+
+		const __m128i ws     = _mm_cmpeq_epi8(enc, zero);
+		const __m128i carry  = _mm_set_epi8(WSlast ? -1 : 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+		const __m128i prevWs = _mm_alignr_epi8(ws, carry, 15);
+		const unsigned int keep = ~static_cast<unsigned int>(_mm_movemask_epi8(_mm_and_si128(ws, prevWs))) & 0xffff;
+
+		outIt += compactStore(enc, keep, outIt, tbl);
+		WSlast = codeLUT[in[ii+15]] == 0;
+	}
+
+	return (outIt - out) + encodeBlockScalar(in + ii, inLen - ii, outIt, codeLUT, symbols, WSlast);
+}
+
+#endif
+
+
+
+/// encodeBlockScalar with the widest vector version available
+inline size_t encodeBlock(const unsigned char* in, size_t inLen, unsigned char* out,
+                          const unsigned char codeLUT[256], unsigned char symbols, bool& WSlast)
+{
+#if defined(__AVX2__)
+	return encodeBlockAVX2(in, inLen, out, codeLUT, symbols, WSlast);
+#elif defined(__SSSE3__)
+	return encodeBlockSSSE3(in, inLen, out, codeLUT, symbols, WSlast);
+#else
+	return encodeBlockScalar(in, inLen, out, codeLUT, symbols, WSlast);
+#endif
+}
+
+
+
+#endif
@@ -1,7 +1,26 @@
 #include "../ngram.h"
+#include "../parallelfor.h"
+#include "../sortedruns.h"
+#include "../modelindex.h"
+#include "encodeblock.h"
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <string>
+#include <cstdio>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 const size_t Symbols = 29; // 26+1+2
@@ -9,37 +28,84 @@ const size_t SymbolBits = 6; // OK up to 32 symbols
 
 
 
+/***
+ * Reads the input file (memory mapped, or in large blocks if mapping fails,
+ * as for pipes) and decodes it to symbols a block at a time. "-" reads stdin.
+ */
 class Charencoder
 {
 public:
 	Charencoder(const char* infile)
-	: is(infile), WSlast(true)
-	{ fillLUT(codeLUT, revCodeLUT); };
+	: fd(strcmp(infile, "-") == 0 ? dup(STDIN_FILENO) : open(infile, O_RDONLY)), mapped(0), mapLen(0), mapPos(0), bytesRead(0), WSlast(true)
+	{
+		fillLUT(codeLUT, revCodeLUT);
+
+		struct stat st;
+		if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+		{
+			void* addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (addr != MAP_FAILED)
+			{
+				mapped = static_cast<const unsigned char*>(addr);
+				mapLen = st.st_size;
+				madvise(addr, mapLen, MADV_SEQUENTIAL);
+			}
+		}
+	};
 
-	class EndOfInput {};
+	~Charencoder()
+	{
+		if (mapped) munmap(const_cast<unsigned char*>(mapped), mapLen);
+		if (fd >= 0) close(fd);
+	};
 
-	unsigned char get()
+	/// decode up to maxLen symbols into out, returns symbol count (0 at end of input)
+	size_t get(unsigned char* out, size_t maxLen)
 	{
-		unsigned char tkn = is.get();
-		while(is.good())
+		size_t outLen = 0;
+		while (outLen == 0)
 		{
-			const unsigned char enc = codeLUT[tkn];
-			if((enc != 0 || !WSlast) && enc < Symbols)
+			const unsigned char* in;
+			size_t inLen;
+			if (mapped)
+			{
+				in = mapped + mapPos;
+				inLen = std::min<size_t>(maxLen, mapLen - mapPos);
+				mapPos += inLen;
+			}
+			else
 			{
-				WSlast = enc == 0;
-				return enc;
+				readBuffer.resize(maxLen);
+				ssize_t got = fd >= 0 ? read(fd, &readBuffer[0], maxLen) : 0;
+				in = &readBuffer[0];
+				inLen = got > 0 ? got : 0;
 			}
-			tkn = is.get();
+			if (inLen == 0)
+				return 0;
+
+			bytesRead += inLen;
+			outLen = encode(in, inLen, out);
 		}
-		throw EndOfInput();
+		return outLen;
 	};
 
+	uint64_t consumed() const { return bytesRead; }; ///< input bytes decoded so far
+
 private:
-	std::ifstream is;
+	int fd;
+	const unsigned char* mapped;
+	size_t mapLen;
+	size_t mapPos;
+	uint64_t bytesRead;
+	std::vector<unsigned char> readBuffer;
 	bool WSlast; // last character whitespace (remove consecutive whitespaces)
 	unsigned char codeLUT[256];
 	char revCodeLUT[Symbols];
 
+	size_t encode(const unsigned char* in, size_t inLen, unsigned char* out)
+	{
+		return encodeBlock(in, inLen, out, codeLUT, Symbols, WSlast);
+	};
 };
 
 
@@ -47,48 +113,582 @@ private:
 
 
 
+/// what to drop from orders 2 and above before writing (see NgramCounter::prune)
+struct PruneSettings
+{
+	uint64_t minCount;  ///< contexts seen fewer times are dropped
+	double   minGain;   ///< contexts with less gain (bits) are dropped
+	uint64_t maxBytes;  ///< drop the lowest gain contexts until the sparseFormat model fits, 0 for no limit
+
+	bool active() const { return minCount > 1 || minGain > 0 || maxBytes > 0; };
+};
+
+
+/// pruning score of a context, see NgramCounter::score
+struct ContextScore
+{
+	float    gain;   ///< count times the divergence from the backoff context in bits
+	uint32_t bytes;  ///< size in sparseFormat
+};
+
+
+
+/***
+ * Counters for all orders 1..N, fed from one shared symbol window.
+ * Orders above the runtime Nmax are kept empty and are not written.
+ * The tables can be spilled to sorted run files to bound memory, the
+ * model is then written by merging the runs of each order (writeMerged).
+ */
 template <unsigned int N>
-void generateNgram(const char* infile, std::ostream& os)
+class NgramCounter : public NgramCounter<N-1>
 {
-	uint64_t samplesParsed = 0;
+public:
+	NgramCounter(unsigned int Nmax)
+	: NgramCounter<N-1>(Nmax), active(N <= Nmax), samplesParsed(0)
+	{ };
 
-	std::cout << "Generating " << N << "-grams..." << std::flush;
+	/// prefix holds the symbols before next, filled is the number of symbols seen so far including next
+	void addSamples(const ContextKey<SymbolBits>& prefix, unsigned char next, uint64_t filled)
+	{
+		if (active && filled > N)
+		{
+			ngram.addSample(prefix, next);
+			++samplesParsed;
+		}
+		NgramCounter<N-1>::addSamples(prefix, next, filled);
+	};
+
+	/// add the counts of one order (0 for all orders) from other
+	void add(const NgramCounter& other, unsigned int order = 0)
+	{
+		if (active && (order == 0 || order == N))
+		{
+			ngram.add(other.ngram);
+			samplesParsed += other.samplesParsed;
+		}
+		NgramCounter<N-1>::add(other, order);
+	};
+
+	/// write the tables of all active orders as sorted runs prefix.<order>.<run>, added to runs[order], and empty them
+	bool spill(const std::string& prefix, uint64_t budget, std::vector<std::vector<std::string> >& runs)
+	{
+		bool good = NgramCounter<N-1>::spill(prefix, budget, runs);
+		if (!active)
+			return good;
+
+		RunSpiller<Symbols> spiller(prefix + "." + std::to_string(N), budget);
+		ngram.visit([&spiller](uint64_t key, uint32_t mask, const uint64_t* packed) { spiller.add(key, mask, packed); });
+		good = spiller.flush() && good;
+		runs[N].insert(runs[N].end(), spiller.runs().begin(), spiller.runs().end());
+		ngram.clear();
+		return good;
+	};
+
+	/**
+	 * Merge the runs of one order into a table file, see writeMergedTable.
+	 * Contexts of orders above 1 seen fewer than minCount times are dropped
+	 * and counted in dropped.
+	 */
+	static bool writeMerged(unsigned int order, const std::vector<std::string>& runs, const std::string& path, NgramFileFormat format,
+	                        uint64_t budget, uint64_t minCount, uint64_t& entries, uint64_t& dropped)
+	{
+		if (order != N)
+			return NgramCounter<N-1>::writeMerged(order, runs, path, format, budget, minCount, entries, dropped);
+
+		dropped = 0;
+		return writeMergedTable<Ngram<N, Symbols, SymbolBits> >(runs, path, format, budget, entries, [&](uint64_t, uint32_t, const uint64_t* packed)
+		{
+			const bool keep = N < 2 || packed[0] >= minCount;
+			dropped += !keep;
+			return keep;
+		});
+	};
+
+	/// counts of a context of one order, false if missing
+	bool lookup(unsigned int order, uint64_t key, uint32_t& mask, uint64_t* packed) const
+	{
+		if (order == N)
+			return active && ngram.lookup(key, mask, packed);
+		return NgramCounter<N-1>::lookup(order, key, mask, packed);
+	};
+
+	/**
+	 * Score the contexts of the active orders in scores[order] (in visit
+	 * order): the context count times the Kullback-Leibler divergence of its
+	 * successor distribution from that of its backoff context (the one
+	 * without the oldest symbol), i.e. how many bits dropping it would cost
+	 * on the counted text. Order 1 contexts are never dropped.
+	 */
+	void score(std::vector<std::vector<ContextScore> >& scores) const
+	{
+		NgramCounter<N-1>::score(scores);
+		if (!active)
+			return;
+
+		std::vector<ContextScore>& dst = scores[N];
+		dst.clear();
+		dst.reserve(ngram.size());
+		const uint64_t suffixMask = (uint64_t(1) << ((N-1)*SymbolBits)) - 1;
+		uint32_t lowMask;
+		uint64_t low[Symbols+1];
+		ngram.visit([&](uint64_t key, uint32_t mask, const uint64_t* packed)
+		{
+			const size_t count = SparseCounts<Symbols, uint64_t>::width(mask)+1;
+			ContextScore cs = {std::numeric_limits<float>::infinity(), uint32_t(N + 5 + (count << SparseCounts<Symbols, uint64_t>::widthCode(packed[0])))};
+			if (N >= 2 && lookup(N-1, key & suffixMask, lowMask, low) && (mask & ~lowMask) == 0)
+			{
+				double gain = 0;
+				size_t idx = 1;
+				for (uint32_t m = mask; m; m &= m-1, ++idx)
+				{
+					const uint32_t bit = m & -m;
+					const double   p   = double(packed[idx]) / packed[0];
+					const double   q   = double(low[1 + __builtin_popcount(lowMask & (bit-1))]) / low[0];
+					gain += packed[idx] * std::log2(p / q);
+				}
+				cs.gain = std::max(gain, 0.0);
+			}
+			dst.push_back(cs);
+		});
+	};
+
+	/// drop contexts of orders above 1 as given by settings and the scores, below or at budgetGain for the size limit
+	void prune(const std::vector<std::vector<ContextScore> >& scores, const PruneSettings& settings, float budgetGain)
+	{
+		NgramCounter<N-1>::prune(scores, settings, budgetGain);
+		if (!active || N < 2)
+			return;
+
+		const std::vector<ContextScore>& src = scores[N];
+		const uint64_t before = ngram.size();
+		uint64_t bytesBefore = 0;
+		uint64_t bytesAfter  = 0;
+		size_t   idx = 0;
+		const uint64_t removed = ngram.prune([&](uint64_t, uint32_t, const uint64_t* packed)
+		{
+			const ContextScore& cs = src[idx++];
+			const bool keep = packed[0] >= settings.minCount && cs.gain >= settings.minGain && cs.gain > budgetGain;
+			bytesBefore += cs.bytes;
+			bytesAfter  += keep ? cs.bytes : 0;
+			return keep;
+		});
+		std::cout << N << "-grams: " << removed << " of " << before << " contexts pruned, " << bytesBefore/1024 << " kB -> " << bytesAfter/1024 << " kB." << std::endl;
+	};
+
+	uint64_t bytes() const { return ngram.bytes() + NgramCounter<N-1>::bytes(); }; ///< memory used by the tables
+	uint64_t parsed(unsigned int order) const { return order == N ? samplesParsed : NgramCounter<N-1>::parsed(order); };
+
+	/// add the counts of all active orders from a model file (past any index), lowest first, return false on mismatch
+	bool read(std::istream& is, unsigned int threadCount)
+	{
+		if (!NgramCounter<N-1>::read(is, threadCount))
+			return false;
+		return !active || (ngram.read(is, threadCount) > 0 && is);
+	};
+
+	/// write all active orders as the sections of out, lowest first, each on up to threadCount threads
+	void write(ModelWriter& out, NgramFileFormat format, unsigned int threadCount, bool verbose = true) const
+	{
+		NgramCounter<N-1>::write(out, format, threadCount, verbose);
+		if (!active) return;
+		if (!verbose)
+		{
+			out.endSection(ngram.write(out.stream(), format, threadCount), format);
+			return;
+		}
+
+		std::cout << N << "-grams: " << samplesParsed << " samples parsed." << std::endl;
+		std::cout << "Writing to file..." << std::flush;
+		uint64_t entries = ngram.write(out.stream(), format, threadCount);
+		out.endSection(entries, format);
+		out.stream() << std::flush;
+
+		uint64_t maxEnt = 1;
+		for (unsigned int ii = 0; ii < N; ++ii)
+			maxEnt *= Symbols;
+
+		std::cout << " " << entries << " of " << maxEnt << " possible N-grams entries written." << std::endl;
+	};
+
+private:
 	Ngram<N, Symbols, SymbolBits> ngram;
-	Charencoder inp(infile);
-	unsigned char data[N+1];
+	const bool active;
+	uint64_t samplesParsed;
+};
+
+
+template <>
+class NgramCounter<0>
+{
+public:
+	NgramCounter(unsigned int) { };
+	void addSamples(const ContextKey<SymbolBits>&, unsigned char, uint64_t) { };
+	void add(const NgramCounter&, unsigned int) { };
+	bool read(std::istream&, unsigned int) { return true; };
+	void write(ModelWriter&, NgramFileFormat, unsigned int, bool) const { };
+	bool spill(const std::string&, uint64_t, std::vector<std::vector<std::string> >&) { return true; };
+	static bool writeMerged(unsigned int, const std::vector<std::string>&, const std::string&, NgramFileFormat, uint64_t, uint64_t, uint64_t&, uint64_t&) { return false; };
+	bool lookup(unsigned int, uint64_t, uint32_t&, uint64_t*) const { return false; };
+	void score(std::vector<std::vector<ContextScore> >&) const { };
+	void prune(const std::vector<std::vector<ContextScore> >&, const PruneSettings&, float) { };
+	uint64_t bytes() const { return 0; };
+	uint64_t parsed(unsigned int) const { return 0; };
+};
+
+
 
-	try
+
+/***
+ * Hands out consecutive decoded blocks of the input to counting threads.
+ * Each block is preceded by the last Nmaxmax symbols of the block before it,
+ * so every sample is counted exactly once. No more blocks are handed out
+ * once limit symbols have been, until the limit is raised.
+ */
+template <unsigned int Nmaxmax>
+class BlockReader
+{
+public:
+	BlockReader(const char* infile)
+	: inp(infile), tail(), symbolsParsed(0), limit(uint64_t(-1)), ended(false)
+	{ };
+
+	/**
+	 * Fill data[Nmaxmax..Nmaxmax+blockLen) with new symbols and data[0..Nmaxmax) with the ones before.
+	 * firstIdx is set to the stream position of the first new symbol.
+	 * Returns new symbol count, 0 at end of input or at the limit.
+	 */
+	size_t next(unsigned char* data, size_t blockLen, uint64_t& firstIdx)
 	{
-		// initial fill
-		for (unsigned int ii = 0; ii < N+1; ++ii)
-			data[ii] = inp.get();
+		std::lock_guard<std::mutex> lock(mutex);
+		if (ended || symbolsParsed >= limit)
+			return 0;
+		std::memcpy(data, tail, Nmaxmax);
+		const size_t got = inp.get(data+Nmaxmax, blockLen);
+		std::memcpy(tail, data+got, Nmaxmax);
+		firstIdx = symbolsParsed;
+		symbolsParsed += got;
+		ended = got == 0;
+		return got;
+	};
+
+	void     setLimit(uint64_t symbols) { limit = symbols; };
+	bool     atEnd() const { return ended; };
+	uint64_t parsed() const { return symbolsParsed; };
+	uint64_t consumed() const { return inp.consumed(); }; ///< input bytes behind the parsed symbols
+
+private:
+	std::mutex mutex;
+	Charencoder inp;
+	unsigned char tail[Nmaxmax];
+	uint64_t symbolsParsed;
+	uint64_t limit;
+	bool ended;
+};
+
+
+
+
+/// threads, output format, checkpoints and memory use (see generateNgrams)
+struct CountSettings
+{
+	unsigned int    threadCount;
+	NgramFileFormat format;
+	uint64_t        checkpointEvery; ///< symbols between checkpoints, 0 for none
+	const char*     resumeFile;      ///< model to add the counts of first, 0 for none
+	uint64_t        budget;          ///< bytes of tables before spilling to run files, 0 for no limit
+	std::string     outfile;         ///< checkpoints and run files are named after it
+	PruneSettings   prune;           ///< applied to the written model, not to checkpoints
+};
+
 
-		// read
-		for (;;)
+
+/**
+ * Prune the orders above 1 of counter as given by settings. For a size
+ * limit, the contexts passing the other limits are dropped by increasing
+ * gain until the model fits.
+ */
+template <unsigned int Nmaxmax>
+void pruneModel(NgramCounter<Nmaxmax>& counter, const unsigned int Nmax, const PruneSettings& settings)
+{
+	std::vector<std::vector<ContextScore> > scores(Nmax+1);
+	counter.score(scores);
+
+	float budgetGain = -std::numeric_limits<float>::infinity();
+	if (settings.maxBytes > 0)
+	{
+		uint64_t total = 14*Nmax;  // headers
+		std::vector<ContextScore> candidates;
+		for (unsigned int order = 1; order <= Nmax; ++order)
 		{
-			ngram.addSample(data);
-			++samplesParsed;
-			for (unsigned int ii = 1; ii < N+1; ++ii)
-				data[ii-1] = data[ii];
-			data[N] = inp.get();
+			for (size_t idx = 0; idx < scores[order].size(); ++idx)
+			{
+				const ContextScore& cs = scores[order][idx];
+				if (order > 1 && cs.gain < settings.minGain)
+					continue;
+				total += cs.bytes;
+				if (order > 1)
+					candidates.push_back(cs);
+			}
+		}
+		std::sort(candidates.begin(), candidates.end(), [](const ContextScore& a, const ContextScore& b) { return a.gain < b.gain; });
+		for (size_t idx = 0; idx < candidates.size() && total > settings.maxBytes; ++idx)
+		{
+			total -= candidates[idx].bytes;
+			budgetGain = candidates[idx].gain;
 		}
 	}
-	catch (Charencoder::EndOfInput& e)
+
+	std::cout << "Pruning..." << std::endl;
+	counter.prune(scores, settings, budgetGain);
+}
+
+
+
+/**
+ * Write orders 1..Nmax from the sorted runs, lowest first, each order
+ * merged into a section file in parallel (each with a thread's share of
+ * the memory budget), then copied to out. Contexts of orders above 1 seen
+ * fewer than minCount times are dropped.
+ * Returns false if a section failed.
+ */
+template <unsigned int Nmaxmax>
+bool writeMergedModel(ModelWriter& out, const std::vector<std::vector<std::string> >& runs, const unsigned int Nmax, const CountSettings& settings,
+                      NgramFileFormat format, uint64_t minCount, std::vector<uint64_t>& entries)
+{
+	std::vector<std::string> sections(Nmax+1);
+	std::vector<uint64_t>    dropped(Nmax+1, 0);
+	std::atomic<bool> failed(false);
+	entries.assign(Nmax+1, 0);
+	parallelFor(Nmax, settings.threadCount, [&](size_t task)
 	{
-		// end of input, continue..
+		const unsigned int order = task+1;
+		sections[order] = settings.outfile + ".section." + std::to_string(order);
+		if (!NgramCounter<Nmaxmax>::writeMerged(order, runs[order], sections[order], format, settings.budget / settings.threadCount, minCount, entries[order], dropped[order]))
+			failed = true;
+	});
+	for (unsigned int order = 2; order <= Nmax && minCount > 1; ++order)
+		std::cout << std::endl << order << "-grams: " << dropped[order] << " of " << dropped[order] + entries[order] << " contexts pruned." << std::flush;
+
+	for (unsigned int order = 1; order <= Nmax; ++order)
+	{
+		if (!failed)
+		{
+			std::ifstream is(sections[order].c_str(), std::ios::binary);
+			out.stream() << is.rdbuf();
+			out.endSection(entries[order], format);
+		}
+		std::remove(sections[order].c_str());
 	}
-	std::cout << " " << samplesParsed << " samples parsed." << std::endl;
+	return !failed && out.stream().flush();
+}
 
 
-	std::cout << "Writing to file..." << std::flush;
-	uint64_t entries = ngram.write(os);
-	os << std::flush;
+
+/**
+ * Count all orders 1..Nmax in a single pass over the input.
+ * With several threads, each counts blocks into its own tables which are
+ * then merged pairwise, all orders of all pairs of a round in parallel.
+ *
+ * With a memory budget, a thread whose tables outgrow its share writes
+ * them out as sorted runs and starts over empty. Once any thread has, all
+ * tables are spilled at the end and the model is written by merging the
+ * runs of each order instead (same counts, entries in key order), so the
+ * tables never take more than the budget (the sorting buffers at most as
+ * much again).
+ *
+ * With checkpointEvery > 0 counting pauses every checkpointEvery symbols,
+ * the tables are merged and the model so far is written (sparseFormat) to
+ * <outfile>.checkpoint, replacing the previous checkpoint only once complete.
+ * Counts of a resume model file are added before counting, an indexed one
+ * is checked against its checksums first. Models are written indexed, see
+ * ModelWriter.
+ * Returns false if the resume model could not be read or a file written.
+ */
+template <unsigned int Nmaxmax>
+bool generateNgrams(const char* infile, std::ostream& os, const unsigned int Nmax, const CountSettings& settings)
+{
+	const unsigned int threadCount = settings.threadCount;
+	BlockReader<Nmaxmax> reader(infile);
+	std::vector<std::unique_ptr<NgramCounter<Nmaxmax> > > counters(threadCount);
+	counters[0].reset(new NgramCounter<Nmaxmax>(Nmax));
+	if (settings.resumeFile)
+	{
+		std::ifstream is(settings.resumeFile, std::ios::binary);
+		ModelIndex index;
+		if (index.read(is) && !index.verify(is, Nmax))
+		{
+			std::cerr << "Model file " << settings.resumeFile << " is truncated or corrupt." << std::endl;
+			return false;
+		}
+		if (!is || !counters[0]->read(is, threadCount))
+		{
+			std::cerr << "Could not read 1- to " << Nmax << "-grams from " << settings.resumeFile << std::endl;
+			return false;
+		}
+		std::cout << "Resuming from " << settings.resumeFile << "." << std::endl;
+	}
+
+	std::cout << "Generating 1- to " << Nmax << "-grams";
+	if (threadCount > 1) std::cout << " using " << threadCount << " threads";
+	std::cout << "..." << std::flush;
+
+	// sorted runs of each thread and order, spilled when over budget
+	const uint64_t threadBudget = settings.budget / threadCount;
+	std::vector<std::vector<std::vector<std::string> > > runs(threadCount, std::vector<std::vector<std::string> >(Nmax+1));
+	std::vector<unsigned int> spills(threadCount, 0);
+	bool outOfCore = false;
+	std::atomic<bool> failed(false);
+	auto spill = [&](size_t thread)
+	{
+		const std::string prefix = settings.outfile + ".run." + std::to_string(thread) + "." + std::to_string(spills[thread]++);
+		if (!counters[thread]->spill(prefix, threadBudget, runs[thread]))
+			failed = true;
+	};
+
+	const std::string checkpointFile = settings.outfile + ".checkpoint";
+	const uint64_t checkpointEvery = settings.checkpointEvery;
+	for (uint64_t checkpoint = checkpointEvery; ; checkpoint += checkpointEvery)
+	{
+		reader.setLimit(checkpointEvery > 0 ? checkpoint : uint64_t(-1));
+		parallelFor(threadCount, threadCount, [&](size_t thread)
+		{
+			if (!counters[thread])
+				counters[thread].reset(new NgramCounter<Nmaxmax>(Nmax));
+			NgramCounter<Nmaxmax>& counter = *counters[thread];
+
+			const size_t blockLen = 1 << 16;
+			std::vector<unsigned char> data(Nmaxmax + blockLen);
+			const unsigned char* block = &data[Nmaxmax];
+
+			uint64_t firstIdx;
+			for (size_t got = reader.next(&data[0], blockLen, firstIdx); got > 0; got = reader.next(&data[0], blockLen, firstIdx))
+			{
+				ContextKey<SymbolBits> prefix;
+				for (size_t ii = 0; ii < Nmaxmax; ++ii)
+					prefix.push(data[ii]);
+
+				for (size_t ii = 0; ii < got; ++ii)
+				{
+					counter.addSamples(prefix, block[ii], firstIdx+ii+1);
+					prefix.push(block[ii]);
+				}
+
+				if (threadBudget > 0 && counter.bytes() > threadBudget)
+					spill(thread);
+			}
+		});
+
+		for (size_t thread = 0; thread < threadCount; ++thread)
+			outOfCore = outOfCore || spills[thread] > 0;
+
+		if (outOfCore)
+		{
+			// everything goes through the runs, the tables are not merged
+			parallelFor(threadCount, threadCount, [&](size_t thread) { spill(thread); });
+		}
+		else
+		{
+			for (size_t step = 1; step < threadCount; step *= 2)
+			{
+				const size_t pairs = (threadCount - step + 2*step - 1) / (2*step);
+				parallelFor(pairs*Nmax, threadCount, [&](size_t task)
+				{
+					const size_t dst = (task / Nmax) * 2*step;
+					counters[dst]->add(*counters[dst+step], task % Nmax + 1);
+				});
+				for (size_t dst = 0; dst + step < threadCount; dst += 2*step)
+					counters[dst+step].reset();
+			}
+		}
+		if (failed)
+			break;
+
+		if (reader.atEnd())
+			break;
+
+		// all blocks up to the limit are counted, so the checkpoint is the model of a prefix of the input
+		const std::string partFile = checkpointFile + ".part";
+		bool written;
+		{
+			std::ofstream cos(partFile.c_str(), std::ios::binary);
+			ModelWriter out(cos, Nmax);
+			if (outOfCore)
+			{
+				std::vector<std::vector<std::string> > orderRuns(Nmax+1);
+				for (size_t thread = 0; thread < threadCount; ++thread)
+					for (unsigned int order = 1; order <= Nmax; ++order)
+						orderRuns[order].insert(orderRuns[order].end(), runs[thread][order].begin(), runs[thread][order].end());
+				std::vector<uint64_t> entries;
+				written = writeMergedModel<Nmaxmax>(out, orderRuns, Nmax, settings, sparseFormat, 0, entries) && out.finish();
+			}
+			else
+			{
+				counters[0]->write(out, sparseFormat, threadCount, false);
+				written = out.finish();
+			}
+		}
+		if (!written || std::rename(partFile.c_str(), checkpointFile.c_str()) != 0)
+			std::cerr << std::endl << "Could not write checkpoint " << checkpointFile << std::flush;
+		else
+			std::cout << std::endl << "Checkpoint after " << reader.parsed() << " symbols (" << reader.consumed() << " input bytes) written to " << checkpointFile << "." << std::flush;
+	}
+	std::cout << (checkpointEvery > 0 ? "\n" : " ") << reader.parsed() << " symbols parsed." << std::endl;
+
+	if (!outOfCore)
+	{
+		if (settings.prune.active())
+			pruneModel(*counters[0], Nmax, settings.prune);
+		ModelWriter out(os, Nmax);
+		counters[0]->write(out, settings.format, threadCount);
+		if (!out.finish())
+		{
+			std::cerr << "Could not write output file." << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	if (settings.prune.minGain > 0 || settings.prune.maxBytes > 0)
+		std::cout << "Gain and size pruning need the tables in memory, only the count limit is applied." << std::endl;
+
+	std::vector<std::vector<std::string> > orderRuns(Nmax+1);
+	size_t runCount = 0;
+	for (size_t thread = 0; thread < threadCount; ++thread)
+	{
+		for (unsigned int order = 1; order <= Nmax; ++order)
+		{
+			orderRuns[order].insert(orderRuns[order].end(), runs[thread][order].begin(), runs[thread][order].end());
+			runCount += runs[thread][order].size();
+		}
+	}
+
+	std::vector<uint64_t> entries;
+	if (!failed)
+	{
+		std::cout << "Merging " << runCount << " sorted runs to file..." << std::flush;
+		ModelWriter out(os, Nmax);
+		if (!writeMergedModel<Nmaxmax>(out, orderRuns, Nmax, settings, settings.format, settings.prune.minCount, entries) || !out.finish())
+			failed = true;
+		std::cout << (settings.prune.minCount > 1 ? "\n" : " ") << "done." << std::endl;
+	}
+	for (unsigned int order = 1; order <= Nmax; ++order)
+		removeRuns(orderRuns[order]);
+	if (failed)
+	{
+		std::cerr << "Could not write sorted runs or output file." << std::endl;
+		return false;
+	}
 
 	uint64_t maxEnt = 1;
-	for (unsigned int ii = 0; ii < N; ++ii)
+	for (unsigned int order = 1; order <= Nmax; ++order)
+	{
+		uint64_t samples = 0;
+		for (size_t thread = 0; thread < threadCount; ++thread)
+			samples += counters[thread]->parsed(order);
 		maxEnt *= Symbols;
-
-	std::cout << " " << entries << " of " << maxEnt << " possible N-grams entries written." << std::endl;
+		std::cout << order << "-grams: " << samples << " samples parsed, " << entries[order] << " of " << maxEnt << " possible N-grams entries written." << std::endl;
+	}
+	return true;
 }
 
 
@@ -96,8 +696,19 @@ void generateNgram(const char* infile, std::ostream& os)
 
 void helptext(const char* progname, unsigned int Nmaxmax)
 {
-	std::cerr << "Usage: " << progname << " <input text file> <output N-gram file> <N-max>" << std::endl;
+	std::cerr << "Usage: " << progname << " <input text file>|- <output N-gram file> <N-max> [options]" << std::endl;
+	std::cerr << "Input - reads stdin (or a pipe) to its end in one pass." << std::endl;
 	std::cerr << "N-max 1-" << Nmaxmax << "\n" << std::endl;
+	std::cerr << "Options:" << std::endl;
+	std::cerr << "  -t <threads>  count, and write the model, using several threads (default 1)" << std::endl;
+	std::cerr << "  -f <format>   raw, sparse (default), compressed (smallest, fastest to load) or mapped (for mapping in ngramsyn)" << std::endl;
+	std::cerr << "  -k <symbols>  write the model so far to <output>.checkpoint every so many input symbols" << std::endl;
+	std::cerr << "  -p <count>    prune contexts (orders 2 and up) seen fewer times" << std::endl;
+	std::cerr << "  -e <bits>     prune contexts costing fewer bits on the input when backing off (count times divergence)" << std::endl;
+	std::cerr << "  -z <MB>       prune the contexts costing the fewest bits until the model fits (in sparse format)" << std::endl;
+	std::cerr << "  -b <MB>       memory for the tables, spilling sorted runs next to the output when full (default no limit)" << std::endl;
+	std::cerr << "  -l <model>    resume: add the counts of a (checkpoint) model file, orders 1 to N-max," << std::endl;
+	std::cerr << "                the input continuing after its input bytes (samples across the seam are lost)\n" << std::endl;
 }
 
 
@@ -123,6 +734,76 @@ int main(int argc, char**argv)
 		return 1;
 	}
 
+	CountSettings settings = {1, sparseFormat, 0, 0, 0, argv[2], {0, 0, 0}};
+	for (int argIdx = 4; argIdx < argc; ++argIdx)
+	{
+		if (strcmp(argv[argIdx], "-t") == 0 && argIdx+1 < argc)
+		{
+			std::istringstream isst(argv[++argIdx]);
+			isst >> settings.threadCount;
+		}
+		else if (strcmp(argv[argIdx], "-k") == 0 && argIdx+1 < argc)
+		{
+			std::istringstream issk(argv[++argIdx]);
+			issk >> settings.checkpointEvery;
+		}
+		else if (strcmp(argv[argIdx], "-b") == 0 && argIdx+1 < argc)
+		{
+			std::istringstream issb(argv[++argIdx]);
+			issb >> settings.budget;
+			settings.budget <<= 20;
+		}
+		else if (strcmp(argv[argIdx], "-p") == 0 && argIdx+1 < argc)
+		{
+			std::istringstream issp(argv[++argIdx]);
+			issp >> settings.prune.minCount;
+		}
+		else if (strcmp(argv[argIdx], "-e") == 0 && argIdx+1 < argc)
+		{
+			std::istringstream isse(argv[++argIdx]);
+			isse >> settings.prune.minGain;
+		}
+		else if (strcmp(argv[argIdx], "-z") == 0 && argIdx+1 < argc)
+		{
+			std::istringstream issz(argv[++argIdx]);
+			issz >> settings.prune.maxBytes;
+			settings.prune.maxBytes <<= 20;
+		}
+		else if (strcmp(argv[argIdx], "-l") == 0 && argIdx+1 < argc)
+			settings.resumeFile = argv[++argIdx];
+		else if (strcmp(argv[argIdx], "-f") == 0 && argIdx+1 < argc && strcmp(argv[argIdx+1], "raw") == 0)
+		{
+			settings.format = rawFormat;
+			++argIdx;
+		}
+		else if (strcmp(argv[argIdx], "-f") == 0 && argIdx+1 < argc && strcmp(argv[argIdx+1], "sparse") == 0)
+		{
+			settings.format = sparseFormat;
+			++argIdx;
+		}
+		else if (strcmp(argv[argIdx], "-f") == 0 && argIdx+1 < argc && strcmp(argv[argIdx+1], "compressed") == 0)
+		{
+			settings.format = compressedFormat;
+			++argIdx;
+		}
+		else if (strcmp(argv[argIdx], "-f") == 0 && argIdx+1 < argc && strcmp(argv[argIdx+1], "mapped") == 0)
+		{
+			settings.format = mappedFormat;
+			++argIdx;
+		}
+		else
+		{
+			helptext(argv[0], Nmaxmax);
+			return 1;
+		}
+	}
+	if (settings.threadCount < 1)
+	{
+		helptext(argv[0], Nmaxmax);
+		return 1;
+	}
+
+	if (strcmp(argv[1], "-") != 0)
 	{
 		std::ifstream is(argv[1], std::ios::binary);
 		if (!is)
@@ -139,36 +820,8 @@ int main(int argc, char**argv)
 		return 1;
 	}
 
-	generateNgram<1>(argv[1], os);
-	if (Nmax == 1) return 0;
-
-	generateNgram<2>(argv[1], os);
-	if (Nmax == 2) return 0;
-
-	generateNgram<3>(argv[1], os);
-	if (Nmax == 3) return 0;
-
-	generateNgram<4>(argv[1], os);
-	if (Nmax == 4) return 0;
-
-	generateNgram<5>(argv[1], os);
-	if (Nmax == 5) return 0;
-
-	generateNgram<6>(argv[1], os);
-	if (Nmax == 6) return 0;
-
-	generateNgram<7>(argv[1], os);
-	if (Nmax == 7) return 0;
-
-	generateNgram<8>(argv[1], os);
-	if (Nmax == 8) return 0;
-
-	generateNgram<9>(argv[1], os);
-	if (Nmax == 9) return 0;
-
-	generateNgram<10>(argv[1], os);
-	if (Nmax == 10) return 0;
-
+	if (!generateNgrams<Nmaxmax>(argv[1], os, Nmax, settings))
+		return 1;
 
 	return 0;
 }
@@ -0,0 +1,311 @@
+/*
+ * Context tree holding the prefixes of all orders, longest match lookup
+ * and backoff without hashing.
+ */
+
+#ifndef CONTEXTTRIE_H
+#define CONTEXTTRIE_H
+
+#include "ngram.h"
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+/***
+ * One node per stored prefix (context) of any order, the root being the
+ * empty context. A child extends its context by one newer symbol, so the
+ * context following a drawn symbol is usually a child of the current one.
+ * Each node links to its suffix (the context without its oldest symbol,
+ * the next shorter order) and to its closest suffix with successors, so
+ * backing off is a pointer hop instead of another table lookup.
+ *
+ * Nodes are stored level by level, the children of a node consecutively
+ * in symbol order and located through a child mask. Counters are stored
+ * per width as in mappedFormat.
+ *
+ * SymCount: cardinality of symbol set (at most 32)
+ * SymBits:  bits needed to enumerate symbol set
+ */
+template <size_t SymCount, size_t SymBits>
+class ContextTrie
+{
+public:
+	static_assert(SymCount <= 32, "child and successor masks are 32 bits");
+
+	typedef uint32_t State; ///< node of the context to draw from
+
+	ContextTrie();
+
+	/**
+	 * Build from the tables of orders 1..maxOrder of source, which calls
+	 * visitor(key, mask, packed) for each prefix of an order through
+	 * source.visit(order, visitor) (see Ngram::visit). Returns false (the
+	 * trie is left empty) if a counter width holds more than 2^30 counters.
+	 */
+	template <typename Source>
+	bool build(const Source& source, unsigned int maxOrder);
+
+	State         start(unsigned int) const { State state = 0; push(state, 0); return state; }; ///< history of one space, orders are limited by build()
+	unsigned char getChar(State& state, uint64_t rand64) const; ///< return 255 if no context matched (state is the root)
+	inline void   push(State& state, unsigned char sym) const; ///< move to the longest context with successors ending in sym, at most one symbol longer
+	void          freeze(); ///< build alias tables for constant time sampling
+
+	/// call visitor(state, mask, packed) for each node with successors, packed as in Ngram::visit
+	template <typename Visitor>
+	void visit(Visitor visitor) const;
+
+	uint64_t size() const { return nodes.size(); };
+	uint64_t bytes() const; ///< memory used by nodes, counters and alias tables
+
+private:
+	struct Node
+	{
+		uint32_t childMask;  ///< newer symbols extending this context
+		uint32_t firstChild; ///< index of the child with the lowest symbol
+		uint32_t suffix;     ///< context without the oldest symbol, 0 (root) for order 1
+		uint32_t backoff;    ///< this node if it has successors, else the closest suffix that has, 0 (root) if none
+		uint32_t mask;       ///< successor mask
+		uint32_t offset;     ///< width code in the two top bits, index of the total count in that width's counter array below
+	};
+
+	std::vector<Node>     nodes;
+	std::vector<uint8_t>  counters8;
+	std::vector<uint16_t> counters16;
+	std::vector<uint32_t> counters32;
+	std::vector<uint64_t> counters64;
+
+	AliasSampler          sampler;
+	std::vector<uint64_t> aliasRefs; // sampler reference per node, empty if not frozen
+
+	uint32_t store(const uint64_t* packed, size_t count, bool& full); ///< offset of the stored counters, sets full if past the 30 bit index
+};
+
+
+
+
+template <size_t SymCount, size_t SymBits>
+ContextTrie<SymCount, SymBits>::
+ContextTrie()
+	: nodes(1, Node())
+{
+
+}
+
+
+
+template <size_t SymCount, size_t SymBits>
+template <typename Source>
+bool ContextTrie<SymCount, SymBits>::
+build(const Source& source, unsigned int maxOrder)
+{
+	// sorted keys of every order, the prefix and suffix of each context are needed as well
+	std::vector< std::vector<uint64_t> > levels(maxOrder+1);
+	for (unsigned int order = 1; order <= maxOrder; ++order)
+	{
+		std::vector<uint64_t>& level = levels[order];
+		source.visit(order, [&level](uint64_t key, uint32_t, const uint64_t*) { level.push_back(key); });
+	}
+	for (unsigned int order = maxOrder; order > 0; --order)
+	{
+		std::vector<uint64_t>& level = levels[order];
+		std::sort(level.begin(), level.end());
+		level.erase(std::unique(level.begin(), level.end()), level.end());
+		const uint64_t suffixMask = (uint64_t(1) << ((order-1)*SymBits)) - 1;
+		for (size_t idx = 0; order > 1 && idx < level.size(); ++idx)
+		{
+			levels[order-1].push_back(level[idx] >> SymBits);
+			levels[order-1].push_back(level[idx] & suffixMask);
+		}
+	}
+
+	std::vector<uint32_t> levelStart(1, 0);
+	levelStart.push_back(1);
+	for (unsigned int order = 1; order <= maxOrder; ++order)
+		levelStart.push_back(levelStart.back() + levels[order].size());
+	nodes.assign(levelStart[maxOrder+1], Node());
+	counters8.clear();
+	counters16.clear();
+	counters32.clear();
+	counters64.clear();
+	sampler.clear();
+	aliasRefs.clear();
+
+	// children are grouped by prefix since the newest symbol is in the low bits
+	for (unsigned int order = 1; order <= maxOrder; ++order)
+	{
+		const std::vector<uint64_t>& level = levels[order];
+		const std::vector<uint64_t>& above = levels[order-1];
+		const uint64_t suffixMask = (uint64_t(1) << ((order-1)*SymBits)) - 1;
+		for (size_t idx = 0; idx < level.size(); ++idx)
+		{
+			const uint32_t node = levelStart[order] + idx;
+			uint32_t parent = 0;
+			if (order > 1)
+			{
+				parent = levelStart[order-1] + (std::lower_bound(above.begin(), above.end(), level[idx] >> SymBits) - above.begin());
+				nodes[node].suffix = levelStart[order-1] + (std::lower_bound(above.begin(), above.end(), level[idx] & suffixMask) - above.begin());
+			}
+			if (!nodes[parent].childMask)
+				nodes[parent].firstChild = node;
+			nodes[parent].childMask |= uint32_t(1) << (level[idx] & ((uint64_t(1) << SymBits) - 1));
+		}
+	}
+
+	bool full = false;
+	for (unsigned int order = 1; order <= maxOrder; ++order)
+	{
+		const std::vector<uint64_t>& level = levels[order];
+		const uint32_t first = levelStart[order];
+		source.visit(order, [&](uint64_t key, uint32_t mask, const uint64_t* packed)
+		{
+			Node& node = nodes[first + (std::lower_bound(level.begin(), level.end(), key) - level.begin())];
+			node.mask   = mask;
+			node.offset = store(packed, __builtin_popcount(mask)+1, full);
+		});
+	}
+	if (full)
+	{
+		*this = ContextTrie();
+		return false;
+	}
+
+	// suffixes come first
+	for (uint32_t node = 1; node < nodes.size(); ++node)
+		nodes[node].backoff = nodes[node].mask ? node : nodes[nodes[node].suffix].backoff;
+	return true;
+}
+
+
+
+template <size_t SymCount, size_t SymBits>
+unsigned char ContextTrie<SymCount, SymBits>::
+getChar(State& state, uint64_t rand64) const
+{
+	const Node& found = nodes[state];
+	if (!found.mask)
+		return 255;
+	if (!aliasRefs.empty())
+		return sampler.sample(aliasRefs[state], rand64);
+
+	const uint32_t idx = found.offset & ((uint32_t(1) << 30) - 1);
+	switch (found.offset >> 30)
+	{
+	case 0:  return sampleSuccessor(found.mask, &counters8[idx], rand64);
+	case 1:  return sampleSuccessor(found.mask, &counters16[idx], rand64);
+	case 2:  return sampleSuccessor(found.mask, &counters32[idx], rand64);
+	default: return sampleSuccessor(found.mask, &counters64[idx], rand64);
+	}
+}
+
+
+
+template <size_t SymCount, size_t SymBits>
+void ContextTrie<SymCount, SymBits>::
+push(State& state, unsigned char sym) const
+{
+	// the deepest level has no children, so orders stay within the built ones
+	const uint32_t bit = uint32_t(1) << sym;
+	uint32_t node = state;
+	while (!(nodes[node].childMask & bit) && node != 0)
+		node = nodes[node].suffix;
+
+	const Node& cur = nodes[node];
+	if (cur.childMask & bit)
+		node = cur.firstChild + __builtin_popcount(cur.childMask & (bit-1));
+	state = nodes[node].backoff;
+}
+
+
+
+template <size_t SymCount, size_t SymBits>
+void ContextTrie<SymCount, SymBits>::
+freeze()
+{
+	sampler.clear();
+	aliasRefs.assign(nodes.size(), 0);
+	for (uint32_t node = 0; node < nodes.size(); ++node)
+	{
+		const Node&    src = nodes[node];
+		const uint32_t idx = src.offset & ((uint32_t(1) << 30) - 1);
+		if (!src.mask)
+			continue;
+
+		switch (src.offset >> 30)
+		{
+		case 0:  aliasRefs[node] = sampler.add(src.mask, &counters8[idx]);  break;
+		case 1:  aliasRefs[node] = sampler.add(src.mask, &counters16[idx]); break;
+		case 2:  aliasRefs[node] = sampler.add(src.mask, &counters32[idx]); break;
+		default: aliasRefs[node] = sampler.add(src.mask, &counters64[idx]); break;
+		}
+	}
+}
+
+
+
+template <size_t SymCount, size_t SymBits>
+template <typename Visitor>
+void ContextTrie<SymCount, SymBits>::
+visit(Visitor visitor) const
+{
+	uint64_t packed[SymCount+1];
+	for (uint32_t node = 0; node < nodes.size(); ++node)
+	{
+		const Node& src = nodes[node];
+		if (!src.mask)
+			continue;
+
+		const size_t   count = __builtin_popcount(src.mask)+1;
+		const uint32_t idx   = src.offset & ((uint32_t(1) << 30) - 1);
+		for (size_t ii = 0; ii < count; ++ii)
+		{
+			switch (src.offset >> 30)
+			{
+			case 0:  packed[ii] = counters8[idx+ii];  break;
+			case 1:  packed[ii] = counters16[idx+ii]; break;
+			case 2:  packed[ii] = counters32[idx+ii]; break;
+			default: packed[ii] = counters64[idx+ii]; break;
+			}
+		}
+		visitor(node, src.mask, packed);
+	}
+}
+
+
+
+template <size_t SymCount, size_t SymBits>
+uint64_t ContextTrie<SymCount, SymBits>::
+bytes() const
+{
+	return nodes.size()*sizeof(Node) + counters8.size() + counters16.size()*2 + counters32.size()*4 + counters64.size()*8
+		+ aliasRefs.size()*8 + sampler.bytes();
+}
+
+
+
+template <size_t SymCount, size_t SymBits>
+uint32_t ContextTrie<SymCount, SymBits>::
+store(const uint64_t* packed, size_t count, bool& full)
+{
+	if (full)
+		return 0;
+	const unsigned int code = SparseCounts<SymCount, uint64_t>::widthCode(packed[0]);
+	uint32_t idx = 0;
+	switch (code)
+	{
+	case 0: idx = counters8.size();  counters8.insert(counters8.end(), packed, packed+count);   break;
+	case 1: idx = counters16.size(); counters16.insert(counters16.end(), packed, packed+count); break;
+	case 2: idx = counters32.size(); counters32.insert(counters32.end(), packed, packed+count); break;
+	case 3: idx = counters64.size(); counters64.insert(counters64.end(), packed, packed+count); break;
+	}
+	if (idx + count > (size_t(1) << 30))
+	{
+		full = true;
+		return 0;
+	}
+	return (code << 30) | idx;
+}
+
+
+
+#endif
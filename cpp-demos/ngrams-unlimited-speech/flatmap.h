@@ -0,0 +1,295 @@
+/*
+ * Open addressing hash map for packed integer keys.
+ */
+
+#ifndef FLATMAP_H
+#define FLATMAP_H
+
+#include "parallelfor.h"
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+/// key hash, slot index is the top bits
+inline uint64_t hashKey(uint64_t key)
+{
+	return key * 0x9E3779B97F4A7C15ULL;
+}
+
+/// key of a hash, the multiplier is odd so hashKey is a bijection
+inline uint64_t unhashKey(uint64_t hash)
+{
+	return hash * 0xF1DE83E19937733DULL;
+}
+
+
+
+/***
+ * Linear probing over a power of two slot table holding (key, entry index).
+ * Entries are stored densely in insertion order, iteration walks them as
+ * std::pair<uint64_t, Value> like an unordered_map.
+ *
+ * Value: default constructed on insertion
+ * The all ones key is reserved.
+ */
+template <typename Value>
+class FlatMap
+{
+public:
+	typedef std::pair<uint64_t, Value>                      EntryType;
+	typedef typename std::vector<EntryType>::iterator       iterator;
+	typedef typename std::vector<EntryType>::const_iterator const_iterator;
+
+	FlatMap() : slotShift(64) { };
+
+	size_t size() const { return entries.size(); };
+
+	iterator       begin()       { return entries.begin(); };
+	iterator       end()         { return entries.end(); };
+	const_iterator begin() const { return entries.begin(); };
+	const_iterator end()   const { return entries.end(); };
+
+	static const size_t npos = ~size_t(0);
+
+	size_t       findIndex(uint64_t key) const; ///< entry index in iteration order, npos if missing
+	Value*       find(uint64_t key);        ///< return 0 if missing
+	const Value* find(uint64_t key) const;  ///< return 0 if missing
+	Value&       operator[](uint64_t key);  ///< insert default value if missing
+
+	void reserve(size_t count);
+	void clear();  ///< remove all entries and release their memory
+
+	/// replace the contents by newEntries (distinct keys, left empty), building the slots on up to threadCount threads
+	void assign(std::vector<EntryType>& newEntries, unsigned int threadCount);
+
+	uint64_t bytes() const { return slots.capacity()*sizeof(Slot) + entries.capacity()*sizeof(EntryType); }; ///< memory allocated for slots and entries
+
+private:
+	struct Slot
+	{
+		uint64_t key;
+		uint64_t idx;
+	};
+
+	static const uint64_t emptyKey = ~uint64_t(0);
+
+	std::vector<Slot>      slots;
+	std::vector<EntryType> entries;
+	unsigned int           slotShift; // 64 - log2(slot count)
+
+	inline size_t slotOf(uint64_t key) const { return hashKey(key) >> slotShift; };
+	void rehash(size_t slotCount);
+};
+
+
+
+
+template <typename Value>
+Value* FlatMap<Value>::
+find(uint64_t key)
+{
+	return const_cast<Value*>(static_cast<const FlatMap*>(this)->find(key));
+}
+
+
+
+template <typename Value>
+const Value* FlatMap<Value>::
+find(uint64_t key) const
+{
+	const size_t idx = findIndex(key);
+	return idx == npos ? 0 : &entries[idx].second;
+}
+
+
+
+template <typename Value>
+size_t FlatMap<Value>::
+findIndex(uint64_t key) const
+{
+	if (slots.empty())
+		return npos;
+
+	const size_t mask = slots.size()-1;
+	for (size_t slot = slotOf(key); ; slot = (slot+1) & mask)
+	{
+		if (slots[slot].key == key)
+			return slots[slot].idx;
+		if (slots[slot].key == emptyKey)
+			return npos;
+	}
+}
+
+
+
+template <typename Value>
+Value& FlatMap<Value>::
+operator[](uint64_t key)
+{
+	// max load factor 1/2
+	if (2*(entries.size()+1) > slots.size())
+		rehash(slots.empty() ? 16 : 2*slots.size());
+
+	const size_t mask = slots.size()-1;
+	size_t slot = slotOf(key);
+	for (; slots[slot].key != emptyKey; slot = (slot+1) & mask)
+	{
+		if (slots[slot].key == key)
+			return entries[slots[slot].idx].second;
+	}
+
+	slots[slot].key = key;
+	slots[slot].idx = entries.size();
+	entries.push_back(EntryType(key, Value()));
+	return entries.back().second;
+}
+
+
+
+template <typename Value>
+void FlatMap<Value>::
+reserve(size_t count)
+{
+	entries.reserve(count);
+	size_t slotCount = 16;
+	while (slotCount < 2*count)
+		slotCount *= 2;
+	if (slotCount > slots.size())
+		rehash(slotCount);
+}
+
+
+
+template <typename Value>
+void FlatMap<Value>::
+clear()
+{
+	std::vector<Slot>().swap(slots);
+	std::vector<EntryType>().swap(entries);
+	slotShift = 64;
+}
+
+
+
+/**
+ * The slot table is split into parts filled concurrently, each from the
+ * entries hashing into it (found by a counting sort over chunks of the
+ * entries). Probes that would run past the end of their part are finished
+ * afterwards, when all parts are done.
+ */
+template <typename Value>
+void FlatMap<Value>::
+assign(std::vector<EntryType>& newEntries, unsigned int threadCount)
+{
+	entries.swap(newEntries);
+	newEntries.clear();
+	size_t slotCount = 16;
+	while (slotCount < 2*entries.size())
+		slotCount *= 2;
+
+	unsigned int partBits = 0;
+	while ((size_t(1) << partBits) < 4*threadCount && (slotCount >> partBits) > (1 << 12))
+		++partBits;
+	if (threadCount < 2 || partBits == 0)
+	{
+		rehash(slotCount);
+		return;
+	}
+
+	Slot empty = {emptyKey, 0};
+	slots.assign(slotCount, empty);
+	slotShift = 64;
+	for (size_t count = slotCount; count > 1; count >>= 1)
+		--slotShift;
+
+	const size_t parts    = size_t(1) << partBits;
+	const size_t partLen  = slotCount >> partBits;
+	const size_t chunkLen = (entries.size() + threadCount-1) / threadCount;
+	std::vector<std::vector<size_t> > start(threadCount, std::vector<size_t>(parts, 0));
+	parallelFor(threadCount, threadCount, [&](size_t chunk)
+	{
+		for (size_t idx = chunk*chunkLen; idx < std::min((chunk+1)*chunkLen, entries.size()); ++idx)
+			++start[chunk][slotOf(entries[idx].first) / partLen];
+	});
+	std::vector<size_t> partStart(parts+1, 0);
+	for (size_t part = 0, pos = 0; part < parts; ++part)
+	{
+		partStart[part] = pos;
+		for (size_t chunk = 0; chunk < threadCount; ++chunk)
+		{
+			const size_t count = start[chunk][part];
+			start[chunk][part] = pos;
+			pos += count;
+		}
+	}
+	partStart[parts] = entries.size();
+
+	std::vector<size_t> order(entries.size());
+	parallelFor(threadCount, threadCount, [&](size_t chunk)
+	{
+		for (size_t idx = chunk*chunkLen; idx < std::min((chunk+1)*chunkLen, entries.size()); ++idx)
+			order[start[chunk][slotOf(entries[idx].first) / partLen]++] = idx;
+	});
+
+	std::vector<std::vector<size_t> > overflow(parts);
+	parallelFor(parts, threadCount, [&](size_t part)
+	{
+		const size_t partEnd = (part+1)*partLen;
+		for (size_t pos = partStart[part]; pos < partStart[part+1]; ++pos)
+		{
+			const size_t idx = order[pos];
+			size_t slot = slotOf(entries[idx].first);
+			while (slot < partEnd && slots[slot].key != emptyKey)
+				++slot;
+			if (slot == partEnd)
+			{
+				overflow[part].push_back(idx);
+				continue;
+			}
+			slots[slot].key = entries[idx].first;
+			slots[slot].idx = idx;
+		}
+	});
+
+	const size_t mask = slotCount-1;
+	for (size_t part = 0; part < parts; ++part)
+	{
+		for (size_t ii = 0; ii < overflow[part].size(); ++ii)
+		{
+			const size_t idx = overflow[part][ii];
+			size_t slot = slotOf(entries[idx].first);
+			while (slots[slot].key != emptyKey)
+				slot = (slot+1) & mask;
+			slots[slot].key = entries[idx].first;
+			slots[slot].idx = idx;
+		}
+	}
+}
+
+
+
+template <typename Value>
+void FlatMap<Value>::
+rehash(size_t slotCount)
+{
+	Slot empty = {emptyKey, 0};
+	slots.assign(slotCount, empty);
+	slotShift = 64;
+	for (size_t count = slotCount; count > 1; count >>= 1)
+		--slotShift;
+
+	const size_t mask = slotCount-1;
+	for (size_t idx = 0; idx < entries.size(); ++idx)
+	{
+		size_t slot = slotOf(entries[idx].first);
+		while (slots[slot].key != emptyKey)
+			slot = (slot+1) & mask;
+		slots[slot].key = entries[idx].first;
+		slots[slot].idx = idx;
+	}
+}
+
+
+
+#endif
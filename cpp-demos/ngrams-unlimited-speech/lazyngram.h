@@ -0,0 +1,242 @@
+/*
+ * Read only N+1-gram table decoded piece by piece as it is queried.
+ */
+
+#ifndef LAZYNGRAM_H
+#define LAZYNGRAM_H
+
+#include "ngram.h"
+#include "mappedfile.h"
+#include "varintblocks.h"
+#include <iostream>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+/***
+ * Queries a table held in memory (such as a section of a mapped model
+ * file), either loaded whole up front (load()) or paged in on demand
+ * (page()). A paged compressedFormat table decodes a block of entries
+ * the first time a prefix in it is queried, finding the block by its
+ * first key. Paged tables of other formats are loaded whole on the first
+ * query. Queries may come from several threads, each piece is decoded once.
+ *
+ * Template parameters as for Ngram.
+ */
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype = uint64_t>
+class LazyNgram
+{
+public:
+	LazyNgram();
+
+	/// load the table of entries entries at data (length bytes) on up to threadCount threads, false if it does not hold it
+	bool load(const unsigned char* data, uint64_t length, uint64_t entries, unsigned int threadCount);
+
+	/// use the table at data (length bytes, must outlive the table) on demand, false if it is no table of this type
+	bool page(const unsigned char* data, uint64_t length);
+
+	unsigned char getChar(const ContextKey<SymBits>& ngram, uint64_t rand64) const; ///< return 255 if no matching ngram, uniform random word
+
+	uint64_t size() const { return entryCount; };
+	uint64_t pieces() const { return spans.empty() ? 1 : spans.size(); };  ///< blocks, 1 for a table loaded whole
+	uint64_t pagedIn() const { return paged; };   ///< pieces decoded so far
+	bool     failed() const { return corrupt; };  ///< a piece was corrupt, its prefixes are missing
+
+private:
+	typedef Ngram<N, SymCount, SymBits, Ctype> NgramType;
+
+	/// a decoded entry, counts at start: total and the nonzero successor counts
+	struct Entry
+	{
+		uint64_t key;
+		uint32_t mask;
+		uint32_t start;
+	};
+
+	/// a decoded block, sorted by key
+	struct Block
+	{
+		Block() : ready(false) { };
+
+		std::atomic<bool>     ready;
+		std::mutex            mutex;
+		std::vector<Entry>    entries;
+		std::vector<uint32_t> counts32;  // when all totals fit, else counts64
+		std::vector<uint64_t> counts64;
+	};
+
+	static const size_t headerLen = 3*2 + 8;
+
+	const unsigned char*     data;
+	uint64_t                 length;
+	uint64_t                 entryCount;
+	std::vector<BlockSpan>   spans;      // empty unless paged compressedFormat
+	std::vector<uint64_t>    firstKeys;  // of each span
+
+	mutable NgramType                 whole;
+	mutable std::atomic<bool>         wholeReady;
+	mutable std::mutex                wholeMutex;
+	mutable std::unique_ptr<Block[]>  blocks;
+	mutable std::atomic<uint64_t>     paged;
+	mutable std::atomic<bool>         corrupt;
+
+	void loadWhole() const;
+	void decode(size_t idx) const;
+};
+
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+LazyNgram<N, SymCount, SymBits, Ctype>::
+LazyNgram()
+	: data(0), length(0), entryCount(0), wholeReady(false), paged(0), corrupt(false)
+{
+
+}
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+bool LazyNgram<N, SymCount, SymBits, Ctype>::
+load(const unsigned char* data, uint64_t length, uint64_t entries, unsigned int threadCount)
+{
+	MemoryBuf buf(data, length);
+	std::istream is(&buf);
+	entryCount = whole.read(is, threadCount);
+	wholeReady = true;
+	paged = 1;
+	return entryCount == entries && is;
+}
+
+
+
+/**
+ * Only the block headers and the first key of each block are read here,
+ * one page of the data per block.
+ */
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+bool LazyNgram<N, SymCount, SymBits, Ctype>::
+page(const unsigned char* data, uint64_t length)
+{
+	MemoryBuf buf(data, length);
+	std::istream is(&buf);
+	const int format = NgramType::readHeader(is, entryCount);
+	if (format < 0)
+		return false;
+
+	this->data   = data;
+	this->length = length;
+	if (format != compressedFormat)
+		return true;
+
+	if (!scanBlocks(data + headerLen, length - headerLen, entryCount, spans))
+		return false;
+	for (size_t idx = 0; idx < spans.size(); ++idx)
+	{
+		const unsigned char* src = data + headerLen + spans[idx].offset;
+		uint64_t key;  // difference to 0
+		if (!getVarint(src, src + spans[idx].length, key) || (idx > 0 && key <= firstKeys.back()))
+			return false;
+		firstKeys.push_back(key);
+	}
+	blocks.reset(new Block[spans.size()]);
+	return true;
+}
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+unsigned char LazyNgram<N, SymCount, SymBits, Ctype>::
+getChar(const ContextKey<SymBits>& ngram, uint64_t rand64) const
+{
+	if (spans.empty())
+	{
+		if (!wholeReady.load(std::memory_order_acquire))
+			loadWhole();
+		return whole.getChar(ngram, rand64);
+	}
+
+	const uint64_t key = ngram.get(N);
+	const size_t   idx = std::upper_bound(firstKeys.begin(), firstKeys.end(), key) - firstKeys.begin();
+	if (idx == 0)
+		return 255;
+	const Block& block = blocks[idx-1];
+	if (!block.ready.load(std::memory_order_acquire))
+		decode(idx-1);
+
+	const typename std::vector<Entry>::const_iterator found = std::lower_bound(block.entries.begin(), block.entries.end(), key,
+		[](const Entry& entry, uint64_t key) { return entry.key < key; });
+	if (found == block.entries.end() || found->key != key)
+		return 255;
+	if (!block.counts32.empty())
+		return sampleSuccessor(found->mask, &block.counts32[found->start], rand64);
+	return sampleSuccessor(found->mask, &block.counts64[found->start], rand64);
+}
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+void LazyNgram<N, SymCount, SymBits, Ctype>::
+loadWhole() const
+{
+	std::lock_guard<std::mutex> lock(wholeMutex);
+	if (wholeReady.load(std::memory_order_relaxed))
+		return;
+
+	if (data)
+	{
+		MemoryBuf buf(data, length);
+		std::istream is(&buf);
+		if (whole.read(is) != entryCount || !is)
+		{
+			whole.clear();
+			corrupt = true;
+		}
+		++paged;
+	}
+	wholeReady.store(true, std::memory_order_release);
+}
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+void LazyNgram<N, SymCount, SymBits, Ctype>::
+decode(size_t idx) const
+{
+	Block& block = blocks[idx];
+	std::lock_guard<std::mutex> lock(block.mutex);
+	if (block.ready.load(std::memory_order_relaxed))
+		return;
+
+	const BlockSpan&      span = spans[idx];
+	std::vector<uint64_t> counts;
+	uint64_t              largest = 0;
+	block.entries.reserve(span.entries);
+	if (!decodeBlock<SymCount>(data + headerLen + span.offset, span.length, span.entries, [&](uint64_t key, uint32_t mask, const uint64_t* packed)
+	{
+		const Entry entry = {key, mask, uint32_t(counts.size())};
+		block.entries.push_back(entry);
+		counts.insert(counts.end(), packed, packed + __builtin_popcount(mask)+1);
+		largest = std::max(largest, packed[0]);
+	}))
+	{
+		block.entries.clear();
+		counts.clear();
+		corrupt = true;
+	}
+
+	if (largest >> 32 == 0)
+		block.counts32.assign(counts.begin(), counts.end());
+	else
+		block.counts64.swap(counts);
+	++paged;
+	block.ready.store(true, std::memory_order_release);
+}
+
+
+
+#endif
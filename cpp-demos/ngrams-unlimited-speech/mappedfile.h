@@ -0,0 +1,73 @@
+/*
+ * Read only memory mapping of a whole file.
+ */
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <streambuf>
+#include <cstddef>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+class MappedFile
+{
+public:
+	MappedFile(const char* path)
+	: mapped(0), mapLen(0)
+	{
+		const int fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return;
+
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+		{
+			void* addr = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (addr != MAP_FAILED)
+			{
+				mapped = static_cast<const unsigned char*>(addr);
+				mapLen = st.st_size;
+			}
+		}
+		close(fd);
+	};
+
+	~MappedFile()
+	{
+		if (mapped) munmap(const_cast<unsigned char*>(mapped), mapLen);
+	};
+
+	bool                 good() const { return mapped != 0; };
+	const unsigned char* data() const { return mapped; };  ///< page aligned
+	size_t               size() const { return mapLen; };
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const unsigned char* mapped;
+	size_t mapLen;
+};
+
+
+
+/***
+ * Stream buffer reading bytes in memory (such as part of a mapped file)
+ * in place, for parsing them through an std::istream.
+ */
+class MemoryBuf : public std::streambuf
+{
+public:
+	MemoryBuf(const unsigned char* data, size_t length)
+	{
+		char* begin = const_cast<char*>(reinterpret_cast<const char*>(data));
+		setg(begin, begin, begin + length);
+	};
+};
+
+
+
+#endif
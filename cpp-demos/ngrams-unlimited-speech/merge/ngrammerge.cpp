@@ -0,0 +1,281 @@
+#include "../ngram.h"
+#include "../sortedruns.h"
+#include "../parallelfor.h"
+#include "../modelindex.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+
+const size_t Symbols = 29; // 26+1+2
+const size_t SymbolBits = 6; // OK up to 32 symbols
+
+
+
+/**
+ * Read orders 1..Nmax of a model file (lowest first, as written by
+ * ngramana, past any index), sorting the entries of each order into run files
+ * prefix.<order>.<run> listed in runs[order]. Memory is bounded by budget
+ * bytes, except for mappedFormat tables which are loaded whole.
+ * Returns false if the file does not hold the orders or a run could not
+ * be written.
+ */
+template <unsigned int N>
+bool spillOrders(std::istream& is, const unsigned int Nmax, const std::string& prefix, uint64_t budget, std::vector<std::vector<std::string> >& runs)
+{
+	if (!spillOrders<N-1>(is, Nmax, prefix, budget, runs))
+		return false;
+	if (N > Nmax)
+		return true;
+
+	typedef Ngram<N, Symbols, SymbolBits> TableType;
+	RunSpiller<Symbols> spiller(prefix + "." + std::to_string(N), budget);
+	auto add = [&spiller](uint64_t key, uint32_t mask, const uint64_t* packed) { spiller.add(key, mask, packed); };
+
+	const std::streampos start = is.tellg();
+	uint64_t  entryCount;
+	const int format = TableType::readHeader(is, entryCount);
+	if (format < 0)
+		return false;
+
+	if (format == mappedFormat)
+	{
+		is.seekg(start);
+		TableType table;
+		table.read(is);
+		table.visit(add);
+	}
+	else if (format == compressedFormat)
+	{
+		if (!TableType::readCompressed(is, entryCount, add))
+			return false;
+	}
+	else
+	{
+		uint64_t key;
+		uint32_t mask;
+		uint64_t packed[Symbols+1];
+		for (uint64_t ii = 0; ii < entryCount && is; ++ii)
+		{
+			TableType::readEntry(is, NgramFileFormat(format), key, mask, packed);
+			add(key, mask, packed);
+		}
+	}
+
+	const bool good = is && spiller.flush();
+	runs[N] = spiller.runs();
+	return good;
+}
+
+
+template <>
+bool spillOrders<0>(std::istream&, const unsigned int, const std::string&, uint64_t, std::vector<std::vector<std::string> >&)
+{
+	return true;
+}
+
+
+
+/// merge the runs of one order into a table file, see writeMergedTable
+template <unsigned int N>
+bool mergeOrder(const unsigned int order, const std::vector<std::string>& runs, const std::string& section, NgramFileFormat format, uint64_t budget, uint64_t& entries)
+{
+	if (order != N)
+		return mergeOrder<N-1>(order, runs, section, format, budget, entries);
+	return writeMergedTable<Ngram<N, Symbols, SymbolBits> >(runs, section, format, budget, entries);
+}
+
+
+template <>
+bool mergeOrder<0>(const unsigned int, const std::vector<std::string>&, const std::string&, NgramFileFormat, uint64_t, uint64_t&)
+{
+	return false;
+}
+
+
+
+
+void helptext(const char* progname, unsigned int Nmaxmax)
+{
+	std::cerr << "Usage: " << progname << " <output N-gram file> <N-max> <input N-gram file>... [options]" << std::endl;
+	std::cerr << "Adds up the counts of orders 1 to N-max of all input models (as written by ngramana)." << std::endl;
+	std::cerr << "N-max 1-" << Nmaxmax << "\n" << std::endl;
+	std::cerr << "Options:" << std::endl;
+	std::cerr << "  -t <threads>  read inputs and merge orders on several threads (default 1)" << std::endl;
+	std::cerr << "  -b <MB>       memory for sorting input entries, shared by the threads (default 1024)" << std::endl;
+	std::cerr << "  -f <format>   raw, sparse (default), compressed or mapped\n" << std::endl;
+}
+
+
+
+
+/**
+ * Each input is read once, its orders sorted into run files next to the
+ * output, all inputs in parallel. Then the runs of each order are merged
+ * in one k-way pass, all orders in parallel, and the sections are
+ * concatenated into the indexed output. The output is written to a part
+ * file renamed at the end, so it may also be one of the inputs.
+ */
+int main(int argc, char**argv)
+{
+	const unsigned int Nmaxmax = 10;
+	unsigned int Nmax;
+
+	// input check
+	if (argc < 4)
+	{
+		helptext(argv[0], Nmaxmax);
+		return 1;
+	}
+
+	std::istringstream iss(argv[2]);
+	iss >> Nmax;
+	if (Nmax < 1 || Nmax > Nmaxmax)
+	{
+		helptext(argv[0], Nmaxmax);
+		return 1;
+	}
+
+	unsigned int threadCount = 1;
+	uint64_t budgetMB = 1024;
+	NgramFileFormat format = sparseFormat;
+	std::vector<const char*> inputs;
+	for (int argIdx = 3; argIdx < argc; ++argIdx)
+	{
+		if (strcmp(argv[argIdx], "-t") == 0 && argIdx+1 < argc)
+		{
+			std::istringstream isst(argv[++argIdx]);
+			isst >> threadCount;
+		}
+		else if (strcmp(argv[argIdx], "-b") == 0 && argIdx+1 < argc)
+		{
+			std::istringstream issb(argv[++argIdx]);
+			issb >> budgetMB;
+		}
+		else if (strcmp(argv[argIdx], "-f") == 0 && argIdx+1 < argc && strcmp(argv[argIdx+1], "raw") == 0)
+		{
+			format = rawFormat;
+			++argIdx;
+		}
+		else if (strcmp(argv[argIdx], "-f") == 0 && argIdx+1 < argc && strcmp(argv[argIdx+1], "sparse") == 0)
+		{
+			format = sparseFormat;
+			++argIdx;
+		}
+		else if (strcmp(argv[argIdx], "-f") == 0 && argIdx+1 < argc && strcmp(argv[argIdx+1], "compressed") == 0)
+		{
+			format = compressedFormat;
+			++argIdx;
+		}
+		else if (strcmp(argv[argIdx], "-f") == 0 && argIdx+1 < argc && strcmp(argv[argIdx+1], "mapped") == 0)
+		{
+			format = mappedFormat;
+			++argIdx;
+		}
+		else if (argv[argIdx][0] == '-')
+		{
+			helptext(argv[0], Nmaxmax);
+			return 1;
+		}
+		else
+			inputs.push_back(argv[argIdx]);
+	}
+	if (threadCount < 1 || budgetMB < 1 || inputs.empty())
+	{
+		helptext(argv[0], Nmaxmax);
+		return 1;
+	}
+
+	const std::string partFile = std::string(argv[1]) + ".part";
+	std::ofstream os(partFile.c_str(), std::ios::binary);
+	if (!os)
+	{
+		std::cerr << "Could not open output file: " << partFile << std::endl;
+		return 1;
+	}
+
+	const std::string tmpPrefix = std::string(argv[1]) + ".merge";
+	const uint64_t budget = (budgetMB << 20) / threadCount;
+
+	std::cout << "Sorting " << inputs.size() << " models..." << std::flush;
+	std::vector<std::vector<std::vector<std::string> > > runs(inputs.size(), std::vector<std::vector<std::string> >(Nmax+1));
+	std::atomic<bool> failed(false);
+	parallelFor(inputs.size(), threadCount, [&](size_t input)
+	{
+		std::ifstream is(inputs[input], std::ios::binary);
+		ModelIndex index;
+		if (index.read(is) && !index.verify(is, Nmax))
+		{
+			std::cerr << std::endl << "Model file " << inputs[input] << " is truncated or corrupt." << std::flush;
+			failed = true;
+			return;
+		}
+		if (!is || !spillOrders<Nmaxmax>(is, Nmax, tmpPrefix + "." + std::to_string(input), budget, runs[input]))
+		{
+			std::cerr << std::endl << "Could not read 1- to " << Nmax << "-grams from " << inputs[input] << std::flush;
+			failed = true;
+		}
+	});
+
+	std::vector<std::vector<std::string> > orderRuns(Nmax+1);
+	size_t runCount = 0;
+	for (size_t input = 0; input < inputs.size(); ++input)
+	{
+		for (unsigned int order = 1; order <= Nmax; ++order)
+		{
+			orderRuns[order].insert(orderRuns[order].end(), runs[input][order].begin(), runs[input][order].end());
+			runCount += runs[input][order].size();
+		}
+	}
+	if (failed)
+	{
+		std::cerr << std::endl;
+		for (unsigned int order = 1; order <= Nmax; ++order)
+			removeRuns(orderRuns[order]);
+		os.close();
+		std::remove(partFile.c_str());
+		return 1;
+	}
+	std::cout << " " << runCount << " sorted runs." << std::endl;
+
+	std::cout << "Merging 1- to " << Nmax << "-grams..." << std::flush;
+	std::vector<std::string> sections(Nmax+1);
+	std::vector<uint64_t>    entries(Nmax+1, 0);
+	parallelFor(Nmax, threadCount, [&](size_t task)
+	{
+		const unsigned int order = task+1;
+		sections[order] = tmpPrefix + ".section." + std::to_string(order);
+		if (!mergeOrder<Nmaxmax>(order, orderRuns[order], sections[order], format, budget, entries[order]))
+			failed = true;
+		removeRuns(orderRuns[order]);
+	});
+	std::cout << " done." << std::endl;
+
+	ModelWriter out(os, Nmax);
+	for (unsigned int order = 1; order <= Nmax; ++order)
+	{
+		if (!failed)
+		{
+			std::ifstream is(sections[order].c_str(), std::ios::binary);
+			out.stream() << is.rdbuf();
+			out.endSection(entries[order], format);
+			std::cout << order << "-grams: " << entries[order] << " entries written." << std::endl;
+		}
+		std::remove(sections[order].c_str());
+	}
+	const bool written = !failed && out.finish();
+	os.close();
+	if (!written || !os || std::rename(partFile.c_str(), argv[1]) != 0)
+	{
+		std::cerr << "Could not write output file: " << argv[1] << std::endl;
+		std::remove(partFile.c_str());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,312 @@
+/*
+ * Indexed model files: a directory of the order sections ahead of the
+ * tables, for selective loading and checking files before parsing them.
+ */
+
+#ifndef MODELINDEX_H
+#define MODELINDEX_H
+
+#include "ngram.h"
+#include <iostream>
+#include <streambuf>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+
+/// CRC-32 (the zlib one) of length bytes, continuing from crc, eight bytes at a time (slice-by-8, little endian hosts)
+inline uint32_t crc32(const unsigned char* data, size_t length, uint32_t crc = 0)
+{
+	// entries[k][b]: crc of byte b followed by k zero bytes
+	struct Table
+	{
+		uint32_t entries[8][256];
+		Table()
+		{
+			for (uint32_t ii = 0; ii < 256; ++ii)
+			{
+				uint32_t value = ii;
+				for (unsigned int bit = 0; bit < 8; ++bit)
+					value = (value >> 1) ^ (value & 1 ? 0xEDB88320 : 0);
+				entries[0][ii] = value;
+			}
+			for (unsigned int slice = 1; slice < 8; ++slice)
+				for (uint32_t ii = 0; ii < 256; ++ii)
+					entries[slice][ii] = (entries[slice-1][ii] >> 8) ^ entries[0][entries[slice-1][ii] & 0xff];
+		};
+	};
+	static const Table table;
+	const uint32_t (&t)[8][256] = table.entries;
+
+	crc = ~crc;
+	for (; length >= 8; data += 8, length -= 8)
+	{
+		uint32_t low, high;
+		std::memcpy(&low, data, 4);
+		std::memcpy(&high, data+4, 4);
+		low ^= crc;
+		crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^ t[5][(low >> 16) & 0xff] ^ t[4][low >> 24]
+		    ^ t[3][high & 0xff] ^ t[2][(high >> 8) & 0xff] ^ t[1][(high >> 16) & 0xff] ^ t[0][high >> 24];
+	}
+	for (size_t ii = 0; ii < length; ++ii)
+		crc = t[0][(crc ^ data[ii]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+
+
+/// where one order's table is in an indexed model file
+struct ModelSection
+{
+	uint64_t offset;    ///< from the start of the file
+	uint64_t length;    ///< bytes of the table, its header included
+	uint64_t entries;   ///< table entry count
+	uint32_t checksum;  ///< crc32 of the table bytes
+	uint32_t format;    ///< NgramFileFormat of the table
+};
+
+
+
+/***
+ * Directory of an indexed model file:
+ *
+ * 8 bytes:                  "NGRAMIDX"
+ * 1 uint32_t:               version (1)
+ * 1 uint32_t:               order count
+ * order count ModelSection: orders 1, 2, ...
+ *
+ * The tables follow in the same order without gaps, as written by
+ * Ngram::write, so a reader past the directory sees a plain model file.
+ * The directory is a multiple of 8 bytes long, mappedFormat tables stay
+ * aligned.
+ */
+class ModelIndex
+{
+public:
+	static const uint32_t version = 1;
+
+	/// read the directory at the current position of is and stay past it, false (is left where it was) if there is none
+	bool read(std::istream& is);
+
+	/// read the directory at the start of data (length bytes), false if there is none
+	bool read(const unsigned char* data, uint64_t length);
+
+	unsigned int        orders() const { return sections.size(); };
+	const ModelSection& section(unsigned int order) const { return sections[order-1]; };  ///< order 1..orders()
+	uint64_t            bytes() const { return 16 + sections.size()*sizeof(ModelSection); }; ///< length of the directory
+
+	/// true if orders 1..Nmax are present and within fileSize bytes
+	bool fits(unsigned int Nmax, uint64_t fileSize) const;
+
+	/// compare the checksum of one order with the file data
+	bool verify(const unsigned char* file, unsigned int order) const
+	{
+		const ModelSection& sec = section(order);
+		return crc32(file + sec.offset, sec.length) == sec.checksum;
+	};
+
+	/// compare the checksums of orders 1..Nmax with the file read from is, which is left at the first section
+	bool verify(std::istream& is, unsigned int Nmax) const;
+
+private:
+	std::vector<ModelSection> sections;
+};
+
+
+
+/***
+ * Writes an indexed model file: tables written to stream() are the
+ * sections of orders 1, 2, ... each ended by endSection(). finish() fills
+ * in the directory written ahead of them, so os must be seekable.
+ */
+class ModelWriter
+{
+public:
+	ModelWriter(std::ostream& os, unsigned int orderCount);
+
+	std::ostream& stream() { return out; };
+
+	/// the bytes written to stream() since the previous section are the table of the next order
+	void endSection(uint64_t entries, NgramFileFormat format);
+
+	/// write the directory, false if os failed or not all orders were written
+	bool finish();
+
+private:
+	ModelWriter(const ModelWriter&);
+	ModelWriter& operator=(const ModelWriter&);
+
+	/// counts and checksums the bytes passed on to target
+	class ChecksumBuf : public std::streambuf
+	{
+	public:
+		ChecksumBuf(std::streambuf* target) : target(target), count(0), crc(0) { };
+
+		std::streambuf* target;
+		uint64_t        count;
+		uint32_t        crc;
+
+	protected:
+		virtual int_type overflow(int_type ch)
+		{
+			if (traits_type::eq_int_type(ch, traits_type::eof()))
+				return traits_type::not_eof(ch);
+			const unsigned char byte = traits_type::to_char_type(ch);
+			crc = crc32(&byte, 1, crc);
+			++count;
+			return target->sputc(byte);
+		};
+
+		virtual std::streamsize xsputn(const char* data, std::streamsize length)
+		{
+			crc = crc32((const unsigned char*)data, length, crc);
+			count += length;
+			return target->sputn(data, length);
+		};
+
+		virtual int sync() { return target->pubsync(); };
+	};
+
+	std::ostream&             os;
+	std::streampos            base;
+	std::vector<ModelSection> sections;
+	unsigned int              orderCount;
+	ChecksumBuf               buf;
+	std::ostream              out;
+	uint64_t                  sectionStart;
+};
+
+
+
+
+inline bool ModelIndex::
+read(std::istream& is)
+{
+	const std::streampos start = is.tellg();
+	char     magic[8];
+	uint32_t header[2];
+	if (!is.read(magic, 8) || std::memcmp(magic, "NGRAMIDX", 8) != 0 || !is.read((char*)header, 2*4) || header[0] != version || header[1] > 64)
+	{
+		is.clear();
+		is.seekg(start);
+		return false;
+	}
+
+	sections.resize(header[1]);
+	if (!is.read((char*)sections.data(), sections.size()*sizeof(ModelSection)))
+	{
+		sections.clear();
+		is.clear();
+		is.seekg(start);
+		return false;
+	}
+	return true;
+}
+
+
+
+inline bool ModelIndex::
+read(const unsigned char* data, uint64_t length)
+{
+	uint32_t header[2];
+	if (length < 16 || std::memcmp(data, "NGRAMIDX", 8) != 0)
+		return false;
+	std::memcpy(header, data+8, 2*4);
+	if (header[0] != version || header[1] > 64 || length < 16 + uint64_t(header[1])*sizeof(ModelSection))
+		return false;
+
+	sections.resize(header[1]);
+	std::memcpy(sections.data(), data+16, sections.size()*sizeof(ModelSection));
+	return true;
+}
+
+
+
+inline bool ModelIndex::
+fits(unsigned int Nmax, uint64_t fileSize) const
+{
+	if (Nmax > sections.size())
+		return false;
+	for (unsigned int order = 1; order <= Nmax; ++order)
+	{
+		const ModelSection& sec = section(order);
+		if (sec.offset < bytes() || sec.offset > fileSize || sec.length > fileSize - sec.offset)
+			return false;
+	}
+	return true;
+}
+
+
+
+inline bool ModelIndex::
+verify(std::istream& is, unsigned int Nmax) const
+{
+	std::vector<unsigned char> chunk(1 << 16);
+	for (unsigned int order = 1; order <= Nmax && order <= sections.size(); ++order)
+	{
+		const ModelSection& sec = section(order);
+		uint32_t crc = 0;
+		is.seekg(sec.offset);
+		for (uint64_t done = 0; done < sec.length; )
+		{
+			const size_t length = std::min<uint64_t>(chunk.size(), sec.length - done);
+			if (!is.read((char*)chunk.data(), length))
+				return false;
+			crc = crc32(chunk.data(), length, crc);
+			done += length;
+		}
+		if (crc != sec.checksum)
+			return false;
+	}
+	is.seekg(bytes());
+	return Nmax <= sections.size() && is.good();
+}
+
+
+
+inline ModelWriter::
+ModelWriter(std::ostream& os, unsigned int orderCount)
+	: os(os), base(os.tellp()), orderCount(orderCount), buf(os.rdbuf()), out(&buf), sectionStart(0)
+{
+	// placeholder until finish()
+	const ModelSection empty = {0, 0, 0, 0, 0};
+	std::vector<ModelSection> placeholder(orderCount, empty);
+	const uint32_t header[2] = {ModelIndex::version, orderCount};
+	os.write("NGRAMIDX", 8);
+	os.write((char*)header, 2*4);
+	os.write((char*)placeholder.data(), placeholder.size()*sizeof(ModelSection));
+	os.flush();
+	buf.count = 16 + placeholder.size()*sizeof(ModelSection);
+	sectionStart = buf.count;
+}
+
+
+
+inline void ModelWriter::
+endSection(uint64_t entries, NgramFileFormat format)
+{
+	const ModelSection sec = {sectionStart, buf.count - sectionStart, entries, buf.crc, uint32_t(format)};
+	sections.push_back(sec);
+	sectionStart = buf.count;
+	buf.crc = 0;
+}
+
+
+
+inline bool ModelWriter::
+finish()
+{
+	out.flush();
+	const uint32_t header[2] = {ModelIndex::version, orderCount};
+	os.seekp(base);
+	os.write("NGRAMIDX", 8);
+	os.write((char*)header, 2*4);
+	os.write((char*)sections.data(), sections.size()*sizeof(ModelSection));
+	os.seekp(0, std::ios::end);
+	return os.flush() && !out.fail() && sections.size() == orderCount;
+}
+
+
+
+#endif
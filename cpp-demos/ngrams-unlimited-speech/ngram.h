@@ -8,47 +8,139 @@
 #define NGRAM_H
 
 #include <iostream>
-#include <bitset>
-#include <unordered_map>
 #include <array>
 #include <cstdint>
+#include <cstring>
+#include <vector>
+#include <utility>
+#include "flatmap.h"
+#include "sparsecounts.h"
+#include "aliassampler.h"
+#include "varintblocks.h"
+#include "parallelfor.h"
+#include <atomic>
+#include <algorithm>
+
+/// serialization formats, see Ngram::write
+enum NgramFileFormat { rawFormat = 0, sparseFormat = 1, mappedFormat = 2, compressedFormat = 3 };
+
+
+
+/**
+ * Hash table slot of a mappedFormat table, see Ngram::write.
+ */
+struct NgramSlot
+{
+	uint64_t key;     ///< packed prefix, all ones for an empty slot
+	uint32_t mask;    ///< successor mask
+	uint32_t offset;  ///< width code in the two top bits, index of the total count in that width's counter array below
+
+	static const uint32_t indexLimit = uint32_t(1) << 30;  ///< counters of one width a table can hold
+};
+
+
+
+/***
+ * Packed history of the most recent symbols, newest in the lowest bits.
+ * The low N*SymBits bits are the key of the last N symbols as used by
+ * Ngram, so one history serves all orders.
+ */
+template <size_t SymBits>
+class ContextKey
+{
+public:
+	ContextKey() : history(0) { };
+
+	inline void     push(unsigned char sym) { history = (history << SymBits) | sym; };
+	inline uint64_t get(size_t n) const { return history & ((uint64_t(1) << (n*SymBits)) - 1); }; ///< key of the last n symbols, n*SymBits < 64
+	inline unsigned char symbol(size_t age) const { return (history >> (age*SymBits)) & ((1 << SymBits) - 1); }; ///< age 0 is the newest symbol
+
+private:
+	uint64_t history;
+};
+
+
 
 /***
  * N: number of symbols in Ngram
  * SymCount: cardinality of symbol set
  * SymBits:  bits needed to enumerate symbol set
- * Ctype:    type of counter (unsigned integer type) or relative freq. (floating point type)
+ * Ctype:    widest type of counter (unsigned integer type), narrower counters are used while counts are small
+ *
+ * Prefixes are packed into a 64 bit key, so N*SymBits may not exceed 63.
  */
 template <size_t N, size_t SymCount, size_t SymBits, typename Ctype = uint64_t>
 class Ngram
 {
 public:
+	typedef uint64_t KeyType;
+	static const size_t symbolCount = SymCount;
+
 	Ngram();
 
 	inline void   addSample(const unsigned char sample[N+1]);
-	unsigned char getChar(const unsigned char ngram[N], double rand01) const; ///< return 255 if no matching ngram
-
-	//TODO: regenerateTotalCount, for floating point tables
-
-	uint64_t write(std::ostream& os) const;  // write serialized values to stream (return entry count)
-	uint64_t read(std::istream& is);     // load serialized values from stream (adds to already existing counts), return loaded entry count
+	inline void   addSample(const ContextKey<SymBits>& prefix, unsigned char next); ///< prefix: last N symbols before next
+	unsigned char getChar(const unsigned char ngram[N], double rand01) const; ///< return 255 if no matching ngram, rand01 in [0, 1)
+	unsigned char getChar(const ContextKey<SymBits>& ngram, uint64_t rand64) const; ///< as above, prefix from the last N symbols of ngram, uniform random word
+	void          add(const Ngram& other); ///< add counts from other table
+	void          freeze(); ///< build alias tables for constant time getChar, dropped again when counts change
+	void          clear();  ///< remove all prefixes and release their memory
+	bool          lookup(KeyType key, uint32_t& mask, uint64_t* packed) const; ///< counts of one prefix as for visit(), false if missing
+
+	/// keep only the prefixes for which keep(key, mask, packed) is true (called as visit() does), return removed count
+	template <typename Keep>
+	uint64_t prune(Keep keep);
+	uint64_t      size() const { return map.size(); };  ///< prefix count
+	uint64_t      bytes() const { return map.bytes() + counts.bytes() + aliasRefs.capacity()*8 + sampler.bytes(); }; ///< memory allocated for the table
+
+	/// call visitor(key, mask, packed) for each prefix, packed as for SparseCounts::get (as uint64_t)
+	template <typename Visitor>
+	void visit(Visitor visitor) const;
+
+	uint64_t write(std::ostream& os, NgramFileFormat format = sparseFormat, unsigned int threadCount = 1) const;  // write serialized values to stream (return entry count)
+	uint64_t read(std::istream& is, unsigned int threadCount = 1);     // load serialized values from stream (adds to already existing counts), return loaded entry count
+
+	/// header and entries as written by write(), for streaming tables without holding them (not mappedFormat or compressedFormat entries)
+	static void writeHeader(std::ostream& os, uint64_t entryCount, NgramFileFormat format);
+	static void writeEntry(std::ostream& os, KeyType key, uint32_t mask, const uint64_t* packed, NgramFileFormat format); ///< packed as for visit()
+	static size_t encodeEntry(unsigned char* out, KeyType key, uint32_t mask, const uint64_t* packed, NgramFileFormat format); ///< as writeEntry() to out (room for maxEntryBytes), return length
+	static int  readHeader(std::istream& is, uint64_t& entryCount); ///< return format, -1 if not a table of this type
+	static void readEntry(std::istream& is, NgramFileFormat format, KeyType& key, uint32_t& mask, uint64_t* packed);
+
+	/// call visitor(key, mask, packed) for the entryCount compressedFormat entries following the header, return false if corrupt
+	template <typename Visitor>
+	static bool readCompressed(std::istream& is, uint64_t entryCount, Visitor visitor) { return readBlocks<SymCount>(is, entryCount, visitor); };
 
 	void dumpRep(std::ostream& os, const char* revCodeLUT) const; ///< print table in readable format (using provided lookup table for characters)
 
+	static inline KeyType toKey(const unsigned char data[N]);
+	static inline void    toCstr(const KeyType keyIn, unsigned char dataOut[N]);
+
 
 
 
 private:
-	typedef std::bitset<N*SymBits>         KeyType;
+	static_assert(N*SymBits < 64, "prefix does not fit in a 64 bit key");
+
 	typedef std::array<Ctype, SymCount+1>  ArrayType; // zeroth index total count
-	typedef std::unordered_map<KeyType, ArrayType> MapType;
+	typedef SparseCounts<SymCount, Ctype>  CountsType;
+	typedef typename CountsType::Ref       RefType;
+	typedef FlatMap<RefType>               MapType;
+
+	MapType    map;
+	CountsType counts;
 
-	MapType map;
+	AliasSampler          sampler;
+	std::vector<uint64_t> aliasRefs; // sampler reference per map entry, empty if not frozen
 
-	inline KeyType toBitset(const unsigned char data[N]) const;
-	inline void toCstr(const KeyType bitsIn, unsigned char dataOut[N]) const;
+	uint64_t writeMapped(std::ostream& os) const;
+	void     readMapped(std::istream& is);
+	uint64_t writeCompressed(std::ostream& os, unsigned int threadCount) const;
+	bool     readCompressedBlocks(std::istream& is, uint64_t entryCount, unsigned int threadCount);
 
-	const KeyType symbolMask;
+	static const KeyType symbolMask = (KeyType(1) << SymBits) - 1;
+	static const size_t  maxEntryBytes = N + 5 + 8*(SymCount+1);
+	static const size_t  chunkEntries = 1 << 12; // entries encoded or decoded per task
 };
 
 
@@ -57,7 +149,6 @@ private:
 template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
 Ngram<N, SymCount, SymBits, Ctype>::
 Ngram()
-	: symbolMask(((1<<SymBits)-1))
 {
 
 }
@@ -68,11 +159,18 @@ template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
 void Ngram<N, SymCount, SymBits, Ctype>::
 addSample(const unsigned char sample[N+1])
 {
-	//++(map[toBitset(sample)].at(idx+1));
-	const size_t idx = sample[N];
-	ArrayType& arr = map[toBitset(sample)];
-	++arr[0];
-	++arr[idx+1];
+	aliasRefs.clear();
+	counts.add(map[toKey(sample)], sample[N]);
+}
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+void Ngram<N, SymCount, SymBits, Ctype>::
+addSample(const ContextKey<SymBits>& prefix, unsigned char next)
+{
+	aliasRefs.clear();
+	counts.add(map[prefix.get(N)], next);
 }
 
 
@@ -81,26 +179,143 @@ template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
 unsigned char  Ngram<N, SymCount, SymBits, Ctype>::
 getChar(const unsigned char ngram[N], double rand01) const
 {
-	auto it = map.find(toBitset(ngram));
-	if (it == map.end())
+	ContextKey<SymBits> key;
+	for (size_t ii = 0; ii < N; ++ii)
+		key.push(ngram[ii]);
+	return getChar(key, randomWord(rand01));
+}
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+unsigned char  Ngram<N, SymCount, SymBits, Ctype>::
+getChar(const ContextKey<SymBits>& ngram, uint64_t rand64) const
+{
+	const KeyType key = ngram.get(N);
+	if (!aliasRefs.empty())
+	{
+		const size_t idx = map.findIndex(key);
+		return idx == MapType::npos ? 255 : sampler.sample(aliasRefs[idx], rand64);
+	}
+
+	const RefType* found = map.find(key);
+	if (!found)
 		return 255;
 
-	const ArrayType& arr = it->second;
+	Ctype arr[SymCount+1];
+	counts.get(*found, arr);
+	return sampleSuccessor(found->mask, arr, rand64);
+}
+
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+void Ngram<N, SymCount, SymBits, Ctype>::
+add(const Ngram& other)
+{
+	aliasRefs.clear();
+	Ctype packed[SymCount+1];
+	for (auto it = other.map.begin(); it != other.map.end(); ++it)
+	{
+		other.counts.get(it->second, packed);
+		counts.add(map[it->first], it->second.mask, packed);
+	}
+}
+
 
-	Ctype selval = rand01*arr[0];
-	for (size_t ii = 1; ii <= SymCount; ++ii)
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+void Ngram<N, SymCount, SymBits, Ctype>::
+freeze()
+{
+	sampler.clear();
+	aliasRefs.clear();
+	aliasRefs.reserve(map.size());
+	Ctype packed[SymCount+1];
+	for (auto it = map.begin(); it != map.end(); ++it)
 	{
-		if (selval < arr[ii])
-			return ii-1;
-		else
-			selval -= arr[ii];
+		counts.get(it->second, packed);
+		aliasRefs.push_back(sampler.add(it->second.mask, packed));
 	}
+}
+
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+void Ngram<N, SymCount, SymBits, Ctype>::
+clear()
+{
+	map.clear();
+	counts.clear();
+	sampler.clear();
+	std::vector<uint64_t>().swap(aliasRefs);
+}
+
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+bool Ngram<N, SymCount, SymBits, Ctype>::
+lookup(KeyType key, uint32_t& mask, uint64_t* packed) const
+{
+	const RefType* found = map.find(key);
+	if (!found)
+		return false;
+
+	Ctype values[SymCount+1];
+	counts.get(*found, values);
+	mask = found->mask;
+	for (size_t ii = 0; ii < CountsType::width(mask)+1; ++ii)
+		packed[ii] = values[ii];
+	return true;
+}
+
 
-	// else return last nonzero
-	for (size_t ii = SymCount; ii > 0; --ii)
-		if (arr[ii] > 0) return ii-1;
 
-	return 255; // should not happen
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+template <typename Keep>
+uint64_t Ngram<N, SymCount, SymBits, Ctype>::
+prune(Keep keep)
+{
+	// rebuilt from the kept prefixes, the tables have no removal
+	Ngram kept;
+	Ctype values[SymCount+1];
+	visit([&](KeyType key, uint32_t mask, const uint64_t* packed)
+	{
+		if (!keep(key, mask, packed))
+			return;
+		for (size_t ii = 0; ii < CountsType::width(mask)+1; ++ii)
+			values[ii] = packed[ii];
+		kept.counts.add(kept.map[key], mask, values);
+	});
+
+	const uint64_t removed = map.size() - kept.map.size();
+	*this = std::move(kept);
+	return removed;
+}
+
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+template <typename Visitor>
+void Ngram<N, SymCount, SymBits, Ctype>::
+visit(Visitor visitor) const
+{
+	Ctype    packed[SymCount+1];
+	uint64_t values[SymCount+1];
+	for (auto it = map.begin(); it != map.end(); ++it)
+	{
+		const size_t count = CountsType::width(it->second.mask)+1;
+		counts.get(it->second, packed);
+		for (size_t ii = 0; ii < count; ++ii)
+			values[ii] = packed[ii];
+		visitor(it->first, it->second.mask, values);
+	}
 }
 
 
@@ -108,85 +323,457 @@ getChar(const unsigned char ngram[N], double rand01) const
 
 /**
  * serialize data
- * 3 uint16_t: N, SymCount, SymBits
+ * 3 uint16_t: N, SymCount, SymBits | (format << 8)
  * 1 uint64_t: table entry count
  *
- * lots of:
+ * rawFormat, lots of:
  * N uint8_t:            prefix.
  * 1 uint64_t:			 total count
  * SymCount uint64_t:    counts for each following symbol
+ *
+ * sparseFormat, lots of:
+ * N uint8_t:            prefix.
+ * 1 uint32_t:           successor mask (bit i set: symbol i follows)
+ * 1 uint8_t:            width code, counters are 1 << code bytes
+ * popcount(mask)+1 counters: total count, then counts of the set mask bits
+ *
+ * mappedFormat, for direct use from memory (see NgramView):
+ * 1 uint16_t:           padding
+ * 1 uint64_t:           slot count (power of two)
+ * 4 uint64_t:           counter count for each width (8, 16, 32, 64 bits)
+ * slot count NgramSlot: hash table, slot hashKey(key) >> (64 - log2(slot count)), linear probing
+ * counter arrays:       64, 32, 16 and 8 bit counters, blocks laid out as in sparseFormat
+ * padding to a multiple of 8 bytes
+ * Tables are 8 byte aligned when the stream position is. A width holds
+ * at most NgramSlot::indexLimit counters, the stream fails on larger ones.
+ *
+ * compressedFormat, prefixes in ascending key order:
+ * blocks of varint coded entries, see BlockEncoder
+ *
+ * Raw, sparse and compressed entries are encoded in chunks on up to
+ * threadCount threads and written out in order.
  */
 template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
 uint64_t Ngram<N, SymCount, SymBits, Ctype>::
-write(std::ostream& os) const
+write(std::ostream& os, NgramFileFormat format, unsigned int threadCount) const
 {
-	uint16_t header[3] = {N, SymCount, SymBits};
-	uint64_t entryCount = map.size();
-	os.write((char*)header, 3*2);
-	os.write((char*)&entryCount, 8);
+	const uint64_t entryCount = map.size();
+	writeHeader(os, entryCount, format);
 
-	uint8_t  prefix[N];
-	uint64_t counts[SymCount+1];
-	for (auto it = map.begin(); it != map.end(); ++it)
-	{
-		toCstr(it->first, prefix);
-		for (size_t ii = 0; ii < SymCount+1; ++ii)
-			counts[ii] = it->second[ii];
+	if (format == mappedFormat)
+		return writeMapped(os);
+	if (format == compressedFormat)
+		return writeCompressed(os, threadCount);
 
-		os.write((char*)prefix, 1*N);
-		os.write((char*)counts, 8*(SymCount+1));
-	}
+	parallelWrite(os, (entryCount + chunkEntries-1) / chunkEntries, threadCount, [&](size_t chunk, std::vector<unsigned char>& out)
+	{
+		auto it = map.begin() + chunk*chunkEntries;
+		auto end = map.begin() + std::min<uint64_t>((chunk+1)*chunkEntries, entryCount);
+		out.resize((end - it)*maxEntryBytes);
+		size_t length = 0;
+		uint64_t values[SymCount+1];
+		Ctype    packed[SymCount+1];
+		for (; it != end; ++it)
+		{
+			const size_t count = CountsType::width(it->second.mask)+1;
+			counts.get(it->second, packed);
+			for (size_t ii = 0; ii < count; ++ii)
+				values[ii] = packed[ii];
+			length += encodeEntry(&out[length], it->first, it->second.mask, values, format);
+		}
+		out.resize(length);
+	});
 
 	return entryCount;
 }
 
 
 /**
- * see write() for format.
+ * see write() for format. Into an empty table, compressedFormat blocks are
+ * decoded on up to threadCount threads, building the counters and the
+ * hash table concurrently as well. The stream fails on corrupt
+ * compressedFormat data.
  */
 template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
 uint64_t Ngram<N, SymCount, SymBits, Ctype>::
-read(std::istream& is)
+read(std::istream& is, unsigned int threadCount)
 {
-	uint16_t header[3];
-	uint64_t entryCount;
-	is.read((char*)header, 3*2);
-	is.read((char*)&entryCount, 8);
-	if(N != header[0] || SymCount != header[1] || SymBits != header[2])
+	uint64_t  entryCount;
+	const int format = readHeader(is, entryCount);
+	if (format < 0)
 		return 0;
 
-	uint8_t  prefix[N];
-	uint64_t counts[SymCount+1];
+	aliasRefs.clear();
+	if (format == mappedFormat)
+	{
+		readMapped(is);
+		return entryCount;
+	}
+
+	Ctype packed[SymCount+1];
+	if (format == compressedFormat && map.size() == 0)
+	{
+		if (!readCompressedBlocks(is, entryCount, threadCount))
+			is.setstate(std::ios::failbit);
+		return entryCount;
+	}
+	if (format == compressedFormat)
+	{
+		map.reserve(map.size() + entryCount);
+		if (!readCompressed(is, entryCount, [&](KeyType key, uint32_t mask, const uint64_t* values)
+		{
+			for (size_t jj = 0; jj < CountsType::width(mask)+1; ++jj)
+				packed[jj] = values[jj];
+			counts.add(map[key], mask, packed);
+		}))
+			is.setstate(std::ios::failbit);
+		return entryCount;
+	}
 
+	KeyType  key;
+	uint32_t mask;
+	uint64_t values[SymCount+1];
 	for (uint64_t ii = 0; ii < entryCount; ++ii)
 	{
-		is.read((char*)prefix, 1*N);
-		is.read((char*)counts, 8*(SymCount+1));
-		ArrayType& arr = map[toBitset(prefix)];
-		for (size_t ii = 0; ii < SymCount+1; ++ii)
-			arr[ii] += counts[ii];
+		readEntry(is, NgramFileFormat(format), key, mask, values);
+		const size_t count = CountsType::width(mask)+1;
+		for (size_t jj = 0; jj < count; ++jj)
+			packed[jj] = values[jj];
+		counts.add(map[key], mask, packed);
 	}
 
 	return entryCount;
 }
 
 
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+void Ngram<N, SymCount, SymBits, Ctype>::
+writeHeader(std::ostream& os, uint64_t entryCount, NgramFileFormat format)
+{
+	uint16_t header[3] = {N, SymCount, uint16_t(SymBits | (format << 8))};
+	os.write((char*)header, 3*2);
+	os.write((char*)&entryCount, 8);
+}
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+void Ngram<N, SymCount, SymBits, Ctype>::
+writeEntry(std::ostream& os, KeyType key, uint32_t mask, const uint64_t* packed, NgramFileFormat format)
+{
+	unsigned char record[maxEntryBytes];
+	os.write((char*)record, encodeEntry(record, key, mask, packed, format));
+}
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+size_t Ngram<N, SymCount, SymBits, Ctype>::
+encodeEntry(unsigned char* out, KeyType key, uint32_t mask, const uint64_t* packed, NgramFileFormat format)
+{
+	toCstr(key, out);
+
+	if (format == rawFormat)
+	{
+		uint64_t values[SymCount+1] = {packed[0]};
+		size_t idx = 1;
+		for (uint32_t m = mask; m; m &= m-1)
+			values[1 + __builtin_ctz(m)] = packed[idx++];
+		std::memcpy(out+N, values, 8*(SymCount+1));
+		return N + 8*(SymCount+1);
+	}
+
+	const size_t count = SparseCounts<SymCount, uint64_t>::width(mask)+1;
+	const unsigned char code = SparseCounts<SymCount, uint64_t>::widthCode(packed[0]);
+	std::memcpy(out+N, &mask, 4);
+	out[N+4] = code;
+	SparseCounts<SymCount, uint64_t>::narrow(packed, count, code, out+N+5);
+	return N + 5 + (count << code);
+}
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+int Ngram<N, SymCount, SymBits, Ctype>::
+readHeader(std::istream& is, uint64_t& entryCount)
+{
+	uint16_t header[3];
+	is.read((char*)header, 3*2);
+	is.read((char*)&entryCount, 8);
+	const unsigned int format = header[2] >> 8;
+	if(!is || N != header[0] || SymCount != header[1] || SymBits != (header[2] & 0xff) || format > compressedFormat)
+		return -1;
+	return format;
+}
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+void Ngram<N, SymCount, SymBits, Ctype>::
+readEntry(std::istream& is, NgramFileFormat format, KeyType& key, uint32_t& mask, uint64_t* packed)
+{
+	uint8_t prefix[N];
+	is.read((char*)prefix, 1*N);
+	key = toKey(prefix);
+
+	if (format == rawFormat)
+	{
+		uint64_t values[SymCount+1];
+		is.read((char*)values, 8*(SymCount+1));
+		SparseCounts<SymCount, uint64_t>::pack(values, mask, packed);
+	}
+	else
+	{
+		unsigned char record[5 + 8*(SymCount+1)];
+		is.read((char*)record, 5);
+		std::memcpy(&mask, record, 4);
+		const unsigned int code  = record[4] & 3;
+		const size_t       count = SparseCounts<SymCount, uint64_t>::width(mask)+1;
+		is.read((char*)record+5, count << code);
+		SparseCounts<SymCount, uint64_t>::widen(record+5, count, code, packed);
+	}
+}
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+uint64_t Ngram<N, SymCount, SymBits, Ctype>::
+writeMapped(std::ostream& os) const
+{
+	uint64_t slotCount = 16;
+	unsigned int slotShift = 60;
+	while (slotCount < 2*map.size())
+	{
+		slotCount *= 2;
+		--slotShift;
+	}
+
+	const NgramSlot empty = {~uint64_t(0), 0, 0};
+	std::vector<NgramSlot> slots(slotCount, empty);
+	std::vector<unsigned char> counters[4];
+	Ctype packed[SymCount+1];
+	for (auto it = map.begin(); it != map.end(); ++it)
+	{
+		const uint32_t     mask  = it->second.mask;
+		const size_t       count = CountsType::width(mask)+1;
+		counts.get(it->second, packed);
+		const unsigned int code  = CountsType::widthCode(packed[0]);
+
+		std::vector<unsigned char>& dst = counters[code];
+		if ((dst.size() >> code) + count > NgramSlot::indexLimit)
+		{
+			std::cerr << "Table too large for mappedFormat: more than 2^30 counters of " << (8 << code) << " bits." << std::endl;
+			os.setstate(std::ios::failbit);
+			return 0;
+		}
+		const uint32_t offset = (code << 30) | (dst.size() >> code);
+		dst.resize(dst.size() + (count << code));
+		CountsType::narrow(packed, count, code, &dst[dst.size() - (count << code)]);
+
+		size_t slot = hashKey(it->first) >> slotShift;
+		while (slots[slot].key != empty.key)
+			slot = (slot+1) & (slotCount-1);
+		NgramSlot& dstSlot = slots[slot];
+		dstSlot.key    = it->first;
+		dstSlot.mask   = mask;
+		dstSlot.offset = offset;
+	}
+
+	const uint16_t padding = 0;
+	uint64_t counterCount[4];
+	for (unsigned int code = 0; code < 4; ++code)
+		counterCount[code] = counters[code].size() >> code;
+	os.write((char*)&padding, 2);
+	os.write((char*)&slotCount, 8);
+	os.write((char*)counterCount, 4*8);
+	os.write((char*)&slots[0], slotCount*sizeof(NgramSlot));
+	uint64_t length = 56 + slotCount*sizeof(NgramSlot);
+	for (unsigned int code = 4; code-- > 0; )
+	{
+		os.write((char*)counters[code].data(), counters[code].size());
+		length += counters[code].size();
+	}
+	const uint64_t zero = 0;
+	os.write((char*)&zero, (8 - length % 8) % 8);
+
+	return map.size();
+}
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+uint64_t Ngram<N, SymCount, SymBits, Ctype>::
+writeCompressed(std::ostream& os, unsigned int threadCount) const
+{
+	// keys and entry indices
+	std::vector<std::pair<KeyType, size_t> > sorted(map.size());
+	parallelFor((sorted.size() + chunkEntries-1) / chunkEntries, threadCount, [&](size_t chunk)
+	{
+		for (size_t ii = chunk*chunkEntries; ii < std::min((chunk+1)*chunkEntries, sorted.size()); ++ii)
+			sorted[ii] = std::make_pair(map.begin()[ii].first, ii);
+	});
+	parallelSort(sorted.begin(), sorted.end(), threadCount);
+
+	// one block per task
+	const size_t blockEntries = BlockEncoder<SymCount>::blockEntries;
+	parallelWrite(os, (sorted.size() + blockEntries-1) / blockEntries, threadCount, [&](size_t block, std::vector<unsigned char>& out)
+	{
+		BlockEncoder<SymCount> encoder;
+		Ctype    packed[SymCount+1];
+		uint64_t values[SymCount+1];
+		for (size_t ii = block*blockEntries; ii < std::min((block+1)*blockEntries, sorted.size()); ++ii)
+		{
+			const RefType& ref = map.begin()[sorted[ii].second].second;
+			counts.get(ref, packed);
+			for (size_t jj = 0; jj < CountsType::width(ref.mask)+1; ++jj)
+				values[jj] = packed[jj];
+			encoder.add(sorted[ii].first, ref.mask, values);
+		}
+		encoder.write(out);
+	});
+
+	return map.size();
+}
+
+
+
+/**
+ * The blocks are read in one go and decoded twice, each on its own task:
+ * first for the keys and the counter block sizes, then, with the counter
+ * pools grown to hold all blocks, for storing the counts. The hash table
+ * is built from the entries last.
+ */
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+bool Ngram<N, SymCount, SymBits, Ctype>::
+readCompressedBlocks(std::istream& is, uint64_t entryCount, unsigned int threadCount)
+{
+	std::vector<unsigned char> data;
+	std::vector<BlockSpan>     blocks;
+	if (!loadBlocks(is, entryCount, data, blocks))
+		return false;
+
+	// counter blocks of each width code and successor count needed by each block, then the index of its first
+	typedef std::array<uint64_t, 4*(SymCount+1)> SizesType;
+	std::vector<typename MapType::EntryType> entries(entryCount);
+	std::vector<SizesType> sizes(blocks.size());
+	std::atomic<bool> failed(false);
+	parallelFor(blocks.size(), threadCount, [&](size_t block)
+	{
+		const BlockSpan& span = blocks[block];
+		SizesType& blockSizes = sizes[block];
+		blockSizes.fill(0);
+		uint64_t idx = span.first;
+		if (!decodeBlock<SymCount>(&data[span.offset], span.length, span.entries, [&](KeyType key, uint32_t mask, const uint64_t* values)
+		{
+			const unsigned int code = CountsType::widthCode(Ctype(values[0]));
+			const RefType ref = {mask, mask ? code << 30 : 0};
+			entries[idx++] = std::make_pair(key, ref);
+			if (mask)
+				++blockSizes[code*(SymCount+1) + CountsType::width(mask)];
+		}))
+			failed = true;
+	});
+	if (failed)
+		return false;
+
+	uint64_t total[4][SymCount+1] = {};
+	for (size_t block = 0; block < blocks.size(); ++block)
+	{
+		for (size_t ii = 0; ii < 4*(SymCount+1); ++ii)
+		{
+			const uint64_t count = sizes[block][ii];
+			sizes[block][ii] = total[ii / (SymCount+1)][ii % (SymCount+1)];
+			total[ii / (SymCount+1)][ii % (SymCount+1)] += count;
+		}
+	}
+	uint32_t first[4][SymCount+1];
+	counts.grow(total, first);
+
+	parallelFor(blocks.size(), threadCount, [&](size_t block)
+	{
+		const BlockSpan& span = blocks[block];
+		SizesType& next = sizes[block];
+		uint64_t idx = span.first;
+		Ctype packed[SymCount+1];
+		decodeBlock<SymCount>(&data[span.offset], span.length, span.entries, [&](KeyType, uint32_t mask, const uint64_t* values)
+		{
+			RefType& ref = entries[idx++].second;
+			if (!mask)
+				return;
+			const unsigned int code = ref.block >> 30;
+			const size_t       slot = code*(SymCount+1) + CountsType::width(mask);
+			ref.block |= first[code][CountsType::width(mask)] + next[slot]++;
+			for (size_t jj = 0; jj < CountsType::width(mask)+1; ++jj)
+				packed[jj] = values[jj];
+			counts.set(ref, packed);
+		});
+	});
+
+	map.assign(entries, threadCount);
+	return true;
+}
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+void Ngram<N, SymCount, SymBits, Ctype>::
+readMapped(std::istream& is)
+{
+	uint16_t padding;
+	uint64_t slotCount;
+	uint64_t counterCount[4];
+	is.read((char*)&padding, 2);
+	is.read((char*)&slotCount, 8);
+	is.read((char*)counterCount, 4*8);
+	if (!is)
+		return;
+
+	std::vector<NgramSlot> slots(slotCount);
+	is.read((char*)slots.data(), slotCount*sizeof(NgramSlot));
+	uint64_t length = 56 + slotCount*sizeof(NgramSlot);
+	std::vector<unsigned char> counters[4];
+	for (unsigned int code = 4; code-- > 0; )
+	{
+		counters[code].resize(counterCount[code] << code);
+		is.read((char*)counters[code].data(), counters[code].size());
+		length += counters[code].size();
+	}
+	uint64_t skip;
+	is.read((char*)&skip, (8 - length % 8) % 8);
+
+	Ctype packed[SymCount+1];
+	for (size_t slot = 0; slot < slotCount; ++slot)
+	{
+		const NgramSlot& src = slots[slot];
+		if (src.key == ~uint64_t(0))
+			continue;
+		const unsigned int code = src.offset >> 30;
+		const size_t       idx  = src.offset & ((uint32_t(1) << 30) - 1);
+		CountsType::widen(&counters[code][idx << code], CountsType::width(src.mask)+1, code, packed);
+		counts.add(map[src.key], src.mask, packed);
+	}
+}
+
+
+
 template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
 void Ngram<N, SymCount, SymBits, Ctype>::
 dumpRep(std::ostream& os, const char* revCodeLUT) const
 {
 
+	ArrayType arr;
 	for (auto it = map.begin(); it != map.end(); ++it)
 	{
 		//os << it->first << " " << it->second << std::endl;
 		unsigned char gram[N];
 		toCstr(it->first, gram);
+		counts.expand(it->second, arr.data());
 		for(size_t ii = 0; ii < N; ++ii)
 			os << revCodeLUT[gram[ii]];
 		os << ": ";
 		for(size_t ii = 1; ii < SymCount+1; ++ii)
-			os << it->second[ii] << " ";
-		os << ": " << it->second[0] << "\n";
+			os << arr[ii] << " ";
+		os << ": " << arr[0] << "\n";
 	}
 }
 
@@ -194,34 +781,31 @@ dumpRep(std::ostream& os, const char* revCodeLUT) const
 
 template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
 typename Ngram<N, SymCount, SymBits, Ctype>::KeyType Ngram<N, SymCount, SymBits, Ctype>::
-toBitset(const unsigned char data[N]) const
+toKey(const unsigned char data[N])
 {
-	KeyType bits;
-	bits |= data[0];
+	KeyType key = data[0];
 	for (size_t ii = 1; ii < N; ++ii)
 	{
-		bits <<= SymBits;
-		bits |=  data[ii];
+		key <<= SymBits;
+		key |=  data[ii];
 	}
 
-	return bits;
+	return key;
 }
 
 
 
 template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
 void Ngram<N, SymCount, SymBits, Ctype>::
-toCstr(const KeyType bitsIn, unsigned char dataOut[N]) const
+toCstr(const KeyType keyIn, unsigned char dataOut[N])
 {
-	KeyType bits = bitsIn;
+	KeyType key = keyIn;
 	for (size_t ii = N-1; ii > 0; --ii)
 	{
-		//dataOut[ii] = 0;
-		dataOut[ii] = (bits & symbolMask).to_ulong();
-		bits >>= SymBits;
+		dataOut[ii] = key & symbolMask;
+		key >>= SymBits;
 	}
-	//dataOut[0] = 0;
-	dataOut[0] = (bits & symbolMask).to_ulong();
+	dataOut[0] = key & symbolMask;
 }
 
 
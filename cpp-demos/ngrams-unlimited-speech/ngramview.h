@@ -0,0 +1,246 @@
+/*
+ * Read only N+1-gram table used in place from a mapped model file.
+ */
+
+#ifndef NGRAMVIEW_H
+#define NGRAMVIEW_H
+
+#include "ngram.h"
+#include <cstring>
+#include <cstdint>
+#include <vector>
+
+/***
+ * Queries a mappedFormat table (see Ngram::write) without copying it.
+ * Template parameters as for Ngram, Ctype is unused.
+ */
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype = uint64_t>
+class NgramView
+{
+public:
+	NgramView();
+
+	/**
+	 * Use the table starting at data (8 byte aligned, at most len bytes).
+	 * Returns the table length including padding, 0 if data does not hold
+	 * a matching mappedFormat table. The slots are checked to refer to
+	 * counters within the table (the counters themselves are not read).
+	 * data must outlive the view.
+	 */
+	uint64_t view(const unsigned char* data, uint64_t len);
+
+	unsigned char getChar(const unsigned char ngram[N], uint64_t rand64) const; ///< return 255 if no matching ngram, uniform random word
+	unsigned char getChar(const ContextKey<SymBits>& ngram, uint64_t rand64) const; ///< as above, prefix from the last N symbols of ngram
+	void          freeze(); ///< build alias tables (on the heap) for constant time getChar
+
+	/// call visitor(key, mask, packed) for each prefix, as Ngram::visit
+	template <typename Visitor>
+	void visit(Visitor visitor) const;
+	uint64_t      size() const { return entryCount; };
+
+private:
+	typedef Ngram<N, SymCount, SymBits, Ctype> NgramType;
+
+	const NgramSlot* slots;
+	uint64_t         slotMask;
+	unsigned int     slotShift;
+	uint64_t         entryCount;
+	const uint8_t*   counters8;
+	const uint16_t*  counters16;
+	const uint32_t*  counters32;
+	const uint64_t*  counters64;
+
+	AliasSampler          sampler;
+	std::vector<uint64_t> aliasRefs; // sampler reference per slot, empty if not frozen
+};
+
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+NgramView<N, SymCount, SymBits, Ctype>::
+NgramView()
+	: slots(0), slotMask(0), slotShift(64), entryCount(0),
+	  counters8(0), counters16(0), counters32(0), counters64(0)
+{
+
+}
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+uint64_t NgramView<N, SymCount, SymBits, Ctype>::
+view(const unsigned char* data, uint64_t len)
+{
+	const uint64_t headerLen = 56;
+	if (len < headerLen || reinterpret_cast<uintptr_t>(data) % 8 != 0)
+		return 0;
+
+	uint16_t header[3];
+	uint64_t slotCount;
+	uint64_t counterCount[4];
+	std::memcpy(header, data, 3*2);
+	std::memcpy(&entryCount, data+6, 8);
+	std::memcpy(&slotCount, data+16, 8);
+	std::memcpy(counterCount, data+24, 4*8);
+	if (N != header[0] || SymCount != header[1] || (SymBits | (mappedFormat << 8)) != header[2])
+		return 0;
+	if (slotCount == 0 || (slotCount & (slotCount-1)) != 0 || slotCount > len / sizeof(NgramSlot))
+		return 0;
+
+	// each count bounded by len, so the sum cannot wrap
+	uint64_t length = headerLen + slotCount*sizeof(NgramSlot);
+	for (unsigned int code = 0; code < 4; ++code)
+	{
+		if (counterCount[code] > len >> code)
+			return 0;
+		length += counterCount[code] << code;
+	}
+	length += (8 - length % 8) % 8;
+	if (length > len)
+		return 0;
+
+	const unsigned char* pos = data + headerLen;
+	slots = reinterpret_cast<const NgramSlot*>(pos);
+	pos += slotCount*sizeof(NgramSlot);
+	counters64 = reinterpret_cast<const uint64_t*>(pos);
+	pos += counterCount[3]*8;
+	counters32 = reinterpret_cast<const uint32_t*>(pos);
+	pos += counterCount[2]*4;
+	counters16 = reinterpret_cast<const uint16_t*>(pos);
+	pos += counterCount[1]*2;
+	counters8 = pos;
+
+	// counter ranges within the arrays, symbols in range and an empty slot ending every probe
+	uint64_t used = 0;
+	for (uint64_t slot = 0; slot < slotCount; ++slot)
+	{
+		const NgramSlot& src = slots[slot];
+		if (src.key == ~uint64_t(0))
+			continue;
+		const uint64_t idx = src.offset & (NgramSlot::indexLimit - 1);
+		if (idx + __builtin_popcount(src.mask) + 1 > counterCount[src.offset >> 30] || (uint64_t(src.mask) >> SymCount) != 0)
+		{
+			slots = 0;
+			return 0;
+		}
+		++used;
+	}
+	if (used != entryCount || used == slotCount)
+	{
+		slots = 0;
+		return 0;
+	}
+
+	sampler.clear();
+	aliasRefs.clear();
+	slotMask = slotCount-1;
+	slotShift = 64;
+	for (uint64_t count = slotCount; count > 1; count >>= 1)
+		--slotShift;
+
+	return length;
+}
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+unsigned char NgramView<N, SymCount, SymBits, Ctype>::
+getChar(const unsigned char ngram[N], uint64_t rand64) const
+{
+	ContextKey<SymBits> key;
+	for (size_t ii = 0; ii < N; ++ii)
+		key.push(ngram[ii]);
+	return getChar(key, rand64);
+}
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+unsigned char NgramView<N, SymCount, SymBits, Ctype>::
+getChar(const ContextKey<SymBits>& ngram, uint64_t rand64) const
+{
+	if (!slots)
+		return 255;
+
+	const uint64_t key = ngram.get(N);
+	for (uint64_t slot = hashKey(key) >> slotShift; ; slot = (slot+1) & slotMask)
+	{
+		const NgramSlot& found = slots[slot];
+		if (found.key == key)
+		{
+			if (!aliasRefs.empty())
+				return sampler.sample(aliasRefs[slot], rand64);
+
+			const uint32_t idx = found.offset & ((uint32_t(1) << 30) - 1);
+			switch (found.offset >> 30)
+			{
+			case 0:  return sampleSuccessor(found.mask, counters8 + idx, rand64);
+			case 1:  return sampleSuccessor(found.mask, counters16 + idx, rand64);
+			case 2:  return sampleSuccessor(found.mask, counters32 + idx, rand64);
+			default: return sampleSuccessor(found.mask, counters64 + idx, rand64);
+			}
+		}
+		if (found.key == ~uint64_t(0))
+			return 255;
+	}
+}
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+void NgramView<N, SymCount, SymBits, Ctype>::
+freeze()
+{
+	sampler.clear();
+	aliasRefs.assign(slots ? slotMask+1 : 0, 0);
+	for (size_t slot = 0; slot < aliasRefs.size(); ++slot)
+	{
+		const NgramSlot& src = slots[slot];
+		if (src.key == ~uint64_t(0))
+			continue;
+
+		const uint32_t idx = src.offset & ((uint32_t(1) << 30) - 1);
+		switch (src.offset >> 30)
+		{
+		case 0:  aliasRefs[slot] = sampler.add(src.mask, counters8 + idx);  break;
+		case 1:  aliasRefs[slot] = sampler.add(src.mask, counters16 + idx); break;
+		case 2:  aliasRefs[slot] = sampler.add(src.mask, counters32 + idx); break;
+		default: aliasRefs[slot] = sampler.add(src.mask, counters64 + idx); break;
+		}
+	}
+}
+
+
+
+template <size_t N, size_t SymCount, size_t SymBits, typename Ctype>
+template <typename Visitor>
+void NgramView<N, SymCount, SymBits, Ctype>::
+visit(Visitor visitor) const
+{
+	uint64_t packed[SymCount+1];
+	for (uint64_t slot = 0; slots && slot <= slotMask; ++slot)
+	{
+		const NgramSlot& src = slots[slot];
+		if (src.key == ~uint64_t(0))
+			continue;
+
+		const size_t   count = __builtin_popcount(src.mask)+1;
+		const uint32_t idx   = src.offset & ((uint32_t(1) << 30) - 1);
+		for (size_t ii = 0; ii < count; ++ii)
+		{
+			switch (src.offset >> 30)
+			{
+			case 0:  packed[ii] = counters8[idx+ii];  break;
+			case 1:  packed[ii] = counters16[idx+ii]; break;
+			case 2:  packed[ii] = counters32[idx+ii]; break;
+			default: packed[ii] = counters64[idx+ii]; break;
+			}
+		}
+		visitor(src.key, src.mask, packed);
+	}
+}
+
+
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Simple parallel loop over task indices, and sorting and writing on
+ * several threads built on it.
+ */
+
+#ifndef PARALLELFOR_H
+#define PARALLELFOR_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <ostream>
+#include <cstddef>
+
+/**
+ * Run f(0) .. f(count-1) on up to threadCount threads.
+ */
+template <typename F>
+void parallelFor(size_t count, unsigned int threadCount, F f)
+{
+	std::atomic<size_t> next(0);
+	auto worker = [&]()
+	{
+		for (size_t idx = next++; idx < count; idx = next++)
+			f(idx);
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned int ii = 1; ii < threadCount && ii < count; ++ii)
+		threads.push_back(std::thread(worker));
+	worker();
+	for (size_t ii = 0; ii < threads.size(); ++ii)
+		threads[ii].join();
+}
+
+
+
+/**
+ * Sort [begin, end) on up to threadCount threads, one chunk per thread,
+ * the sorted chunks merged pairwise.
+ */
+template <typename Iterator>
+void parallelSort(Iterator begin, Iterator end, unsigned int threadCount)
+{
+	const size_t count = end - begin;
+	if (threadCount < 2 || count < (1 << 16))
+	{
+		std::sort(begin, end);
+		return;
+	}
+
+	const size_t chunkLen = (count + threadCount-1) / threadCount;
+	parallelFor(threadCount, threadCount, [&](size_t chunk)
+	{
+		std::sort(begin + std::min(chunk*chunkLen, count), begin + std::min((chunk+1)*chunkLen, count));
+	});
+	for (size_t step = 1; step < threadCount; step *= 2)
+	{
+		parallelFor((threadCount + 2*step-1) / (2*step), threadCount, [&](size_t pair)
+		{
+			const size_t first  = std::min(pair*2*step*chunkLen, count);
+			const size_t middle = std::min(first + step*chunkLen, count);
+			const size_t last   = std::min(middle + step*chunkLen, count);
+			std::inplace_merge(begin + first, begin + middle, begin + last);
+		});
+	}
+}
+
+
+
+/**
+ * Run encode(idx, buffer) for idx 0 .. count-1 on up to threadCount
+ * threads, each filling an empty byte buffer, and write the buffers to os
+ * in index order. A few buffers per thread are held at a time.
+ */
+template <typename Encode>
+void parallelWrite(std::ostream& os, size_t count, unsigned int threadCount, Encode encode)
+{
+	const size_t roundLen = 4*threadCount;
+	std::vector<std::vector<unsigned char> > buffers(std::min(roundLen, count));
+	for (size_t first = 0; first < count; first += roundLen)
+	{
+		const size_t tasks = std::min(roundLen, count - first);
+		parallelFor(tasks, threadCount, [&](size_t task)
+		{
+			buffers[task].clear();
+			encode(first + task, buffers[task]);
+		});
+		for (size_t task = 0; task < tasks; ++task)
+			os.write((const char*)buffers[task].data(), buffers[task].size());
+	}
+}
+
+
+
+#endif
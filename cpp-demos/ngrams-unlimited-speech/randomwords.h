@@ -0,0 +1,97 @@
+/*
+ * Random number generators handing out uniform 64 bit words for sampling.
+ */
+
+#ifndef RANDOMWORDS_H
+#define RANDOMWORDS_H
+
+#include <random>
+#include <cstdint>
+
+/***
+ * xoshiro256** (Blackman and Vigna). The state is filled from the seed by
+ * splitmix64, stream k then jumps k times 2^128 steps ahead so streams of
+ * one seed never overlap.
+ */
+class Xoshiro256
+{
+public:
+	Xoshiro256(uint64_t seed, uint64_t stream = 0)
+	{
+		for (unsigned int ii = 0; ii < 4; ++ii)
+		{
+			seed += 0x9E3779B97F4A7C15ULL;
+			uint64_t mix = seed;
+			mix = (mix ^ (mix >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			mix = (mix ^ (mix >> 27)) * 0x94D049BB133111EBULL;
+			state[ii] = mix ^ (mix >> 31);
+		}
+		for (uint64_t ii = 0; ii < stream; ++ii)
+			jump();
+	};
+
+	inline uint64_t operator()()
+	{
+		const uint64_t result = rotl(state[1] * 5, 7) * 9;
+		const uint64_t shifted = state[1] << 17;
+		state[2] ^= state[0];
+		state[3] ^= state[1];
+		state[1] ^= state[2];
+		state[0] ^= state[3];
+		state[2] ^= shifted;
+		state[3] = rotl(state[3], 45);
+		return result;
+	};
+
+	void jump()
+	{
+		static const uint64_t polynomial[4] = {0x180EC6D33CFD0ABAULL, 0xD5A61266F0C9392CULL, 0xA9582618E03FC9AAULL, 0x39ABDC4529B1661CULL};
+		uint64_t jumped[4] = {0, 0, 0, 0};
+		for (unsigned int word = 0; word < 4; ++word)
+		{
+			for (unsigned int bit = 0; bit < 64; ++bit)
+			{
+				if (polynomial[word] & (uint64_t(1) << bit))
+				{
+					for (unsigned int ii = 0; ii < 4; ++ii)
+						jumped[ii] ^= state[ii];
+				}
+				(*this)();
+			}
+		}
+		for (unsigned int ii = 0; ii < 4; ++ii)
+			state[ii] = jumped[ii];
+	};
+
+private:
+	uint64_t state[4];
+
+	static inline uint64_t rotl(uint64_t value, int shift) { return (value << shift) | (value >> (64 - shift)); };
+};
+
+
+
+/***
+ * Words from a standard library engine, seeded from seed and stream
+ * through a seed_seq.
+ */
+template <typename Engine>
+class StdRandom
+{
+public:
+	StdRandom(uint64_t seed, uint64_t stream = 0)
+	{
+		std::seed_seq seq = {uint32_t(seed), uint32_t(seed >> 32), uint32_t(stream), uint32_t(stream >> 32)};
+		engine.seed(seq);
+	};
+
+	inline uint64_t operator()() { return words(engine); };
+
+private:
+	Engine engine;
+	std::uniform_int_distribution<uint64_t> words;
+};
+
+
+
+#endif
@@ -0,0 +1,529 @@
+/*
+ * Table entries in sorted temporary run files and their k-way merge, for
+ * handling tables larger than memory.
+ */
+
+#ifndef SORTEDRUNS_H
+#define SORTEDRUNS_H
+
+#include "ngram.h"
+#include "sparsecounts.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+/***
+ * Writes entries (key, mask, packed counts as for Ngram::visit) to a run
+ * file, each as an 8 byte key followed by a sparseFormat record.
+ */
+template <size_t SymCount>
+class RunWriter
+{
+public:
+	RunWriter() : buffer(1 << 20) { };
+
+	bool open(const std::string& path)
+	{
+		os.rdbuf()->pubsetbuf(&buffer[0], buffer.size());
+		os.open(path.c_str(), std::ios::binary | std::ios::trunc);
+		return os.good();
+	};
+
+	void write(uint64_t key, uint32_t mask, const uint64_t* packed)
+	{
+		const size_t count = CountsType::width(mask)+1;
+		const unsigned char code = CountsType::widthCode(packed[0]);
+		unsigned char record[13 + 8*(SymCount+1)];
+		std::memcpy(record, &key, 8);
+		std::memcpy(record+8, &mask, 4);
+		record[12] = code;
+		CountsType::narrow(packed, count, code, record+13);
+		os.write((char*)record, 13 + (count << code));
+	};
+
+	bool close()
+	{
+		os.close();
+		return !os.fail();
+	};
+
+private:
+	typedef SparseCounts<SymCount, uint64_t> CountsType;
+
+	std::vector<char> buffer;
+	std::ofstream     os;
+};
+
+
+
+/***
+ * Reads the entries of a run file in order.
+ */
+template <size_t SymCount>
+class RunReader
+{
+public:
+	RunReader() : buffer(1 << 16), curKey(0), curMask(0), truncated(false) { };  // many are read at once
+
+	bool open(const std::string& path)
+	{
+		is.rdbuf()->pubsetbuf(&buffer[0], buffer.size());
+		is.open(path.c_str(), std::ios::binary);
+		return is.good();
+	};
+
+	/// advance to the next entry, false at the end of the run or if it ends within an entry (see failed())
+	bool next()
+	{
+		unsigned char record[13];
+		if (!is.read((char*)record, 13))
+		{
+			truncated = is.gcount() != 0 || is.bad();
+			return false;
+		}
+		std::memcpy(&curKey, record, 8);
+		std::memcpy(&curMask, record+8, 4);
+		const unsigned int code  = record[12] & 3;
+		const size_t       count = CountsType::width(curMask)+1;
+		unsigned char counters[8*(SymCount+1)];
+		if (!is.read((char*)counters, count << code))
+		{
+			truncated = true;
+			return false;
+		}
+		CountsType::widen(counters, count, code, curPacked);
+		return true;
+	};
+
+	uint64_t        key() const { return curKey; };
+	uint32_t        mask() const { return curMask; };
+	const uint64_t* packed() const { return curPacked; };
+	bool            failed() const { return truncated; }; ///< the run ended within an entry or could not be read
+
+private:
+	typedef SparseCounts<SymCount, uint64_t> CountsType;
+
+	std::vector<char> buffer;
+	std::ifstream     is;
+	uint64_t          curKey;
+	uint32_t          curMask;
+	uint64_t          curPacked[SymCount+1];
+	bool              truncated;
+};
+
+
+
+/***
+ * Collects entries in memory and writes them out as a sorted run file
+ * whenever they take up more than budget bytes, so any number of entries
+ * can be sorted in bounded memory. Run files are named prefix.0, prefix.1...
+ */
+template <size_t SymCount>
+class RunSpiller
+{
+public:
+	RunSpiller(const std::string& prefix, uint64_t budget)
+	: prefix(prefix), budget(budget), failed(false)
+	{ };
+
+	void add(uint64_t key, uint32_t mask, const uint64_t* packed)
+	{
+		index.push_back(std::make_pair(key, data.size()));
+		data.push_back(mask);
+		data.insert(data.end(), packed, packed + SparseCounts<SymCount, uint64_t>::width(mask)+1);
+		if (bytes() > budget)
+			flush();
+	};
+
+	/// write the collected entries as a run, return false if any run failed to be written
+	bool flush();
+
+	const std::vector<std::string>& runs() const { return runFiles; };
+	uint64_t bytes() const { return index.size()*sizeof(IndexType) + data.size()*8; }; ///< memory held by entries
+
+private:
+	typedef std::pair<uint64_t, size_t> IndexType; // key, position of mask and counts in data
+
+	std::string              prefix;
+	uint64_t                 budget;
+	std::vector<IndexType>   index;
+	std::vector<uint64_t>    data;
+	std::vector<std::string> runFiles;
+	bool                     failed;
+};
+
+
+
+/// most runs read at once (an open file and buffer each), more are merged in several passes
+const size_t maxMergeFanIn = 64;
+
+/**
+ * Merge the sorted runs, calling visitor(key, mask, packed) for each key in
+ * ascending order with the counts of that key in all runs added.
+ * More than maxMergeFanIn runs are first merged in groups into
+ * intermediate runs (named after the first run of each group, removed
+ * again) until few enough are left.
+ * Returns false if a run could not be opened, read to its end or written.
+ */
+template <size_t SymCount, typename Visitor>
+bool mergeRuns(const std::vector<std::string>& runs, Visitor visitor);
+
+/**
+ * Merge the sorted runs into a file holding one table of Table (an Ngram,
+ * as written by Table::write), entries in key order. mappedFormat tables
+ * are merged to sparseFormat first and then rewritten by writeMappedTable
+ * with budget (bytes, above 0), compressedFormat tables are coded as they
+ * stream past.
+ * Only entries for which keep(key, mask, packed) is true are written.
+ * Returns false on failure, entries is set to the written entry count.
+ */
+template <typename Table, typename Keep>
+bool writeMergedTable(const std::vector<std::string>& runs, const std::string& path, NgramFileFormat format, uint64_t budget, uint64_t& entries, Keep keep);
+
+template <typename Table>
+bool writeMergedTable(const std::vector<std::string>& runs, const std::string& path, NgramFileFormat format, uint64_t budget, uint64_t& entries)
+{
+	return writeMergedTable<Table>(runs, path, format, budget, entries, [](uint64_t, uint32_t, const uint64_t*) { return true; });
+}
+
+/**
+ * Rewrite the sparseFormat table file sparsePath as a mappedFormat table
+ * (see Ngram::write) at path without holding it: the entries are sorted
+ * by hash through runs (prefix path.h) of at most budget bytes, so the
+ * slots fill in order, each entry in the first free slot from its home
+ * slot on. The few entries probing past the last slot wrap around to the
+ * first empty ones. Counters are collected in a file per width and
+ * appended. Returns false on failure.
+ */
+template <typename Table>
+bool writeMappedTable(const std::string& sparsePath, const std::string& path, uint64_t budget);
+
+/// delete run files
+inline void removeRuns(const std::vector<std::string>& runs)
+{
+	for (size_t ii = 0; ii < runs.size(); ++ii)
+		std::remove(runs[ii].c_str());
+}
+
+
+
+
+template <size_t SymCount>
+bool RunSpiller<SymCount>::
+flush()
+{
+	if (index.empty())
+		return !failed;
+
+	std::sort(index.begin(), index.end());
+	RunWriter<SymCount> writer;
+	runFiles.push_back(prefix + "." + std::to_string(runFiles.size()));
+	if (!writer.open(runFiles.back()))
+		failed = true;
+	for (size_t ii = 0; ii < index.size(); ++ii)
+	{
+		const uint64_t* entry = &data[index[ii].second];
+		writer.write(index[ii].first, uint32_t(entry[0]), entry+1);
+	}
+	if (!writer.close())
+		failed = true;
+
+	// release the memory, not just the contents
+	std::vector<IndexType>().swap(index);
+	std::vector<uint64_t>().swap(data);
+	return !failed;
+}
+
+
+
+/// one k-way merge of all runs, see mergeRuns
+template <size_t SymCount, typename Visitor>
+bool mergeRunsAtOnce(const std::vector<std::string>& runs, Visitor visitor)
+{
+	typedef std::pair<uint64_t, size_t> HeadType; // key, run
+	std::priority_queue<HeadType, std::vector<HeadType>, std::greater<HeadType> > heads;
+	std::vector<std::unique_ptr<RunReader<SymCount> > > readers(runs.size());
+	for (size_t run = 0; run < runs.size(); ++run)
+	{
+		readers[run].reset(new RunReader<SymCount>());
+		if (!readers[run]->open(runs[run]))
+			return false;
+		if (readers[run]->next())
+			heads.push(HeadType(readers[run]->key(), run));
+		else if (readers[run]->failed())
+		{
+			std::cerr << "Run file " << runs[run] << " is truncated." << std::endl;
+			return false;
+		}
+	}
+
+	uint64_t counts[SymCount+1];
+	uint64_t packed[SymCount+1];
+	while (!heads.empty())
+	{
+		const uint64_t key = heads.top().first;
+		std::fill(counts, counts+SymCount+1, 0);
+		while (!heads.empty() && heads.top().first == key)
+		{
+			const size_t run = heads.top().second;
+			RunReader<SymCount>& reader = *readers[run];
+			heads.pop();
+
+			const uint64_t* src = reader.packed();
+			counts[0] += src[0];
+			size_t idx = 1;
+			for (uint32_t m = reader.mask(); m; m &= m-1)
+				counts[1 + __builtin_ctz(m)] += src[idx++];
+
+			if (reader.next())
+				heads.push(HeadType(reader.key(), run));
+			else if (reader.failed())
+			{
+				std::cerr << "Run file " << runs[run] << " is truncated." << std::endl;
+				return false;
+			}
+		}
+		uint32_t mask;
+		SparseCounts<SymCount, uint64_t>::pack(counts, mask, packed);
+		visitor(key, mask, packed);
+	}
+	return true;
+}
+
+
+
+/// merge groups of maxMergeFanIn runs into one run each, listed in merged
+template <size_t SymCount>
+bool mergeRunGroups(const std::vector<std::string>& runs, std::vector<std::string>& merged)
+{
+	for (size_t first = 0; first < runs.size(); first += maxMergeFanIn)
+	{
+		const std::vector<std::string> group(runs.begin() + first, runs.begin() + std::min(first + maxMergeFanIn, runs.size()));
+		RunWriter<SymCount> writer;
+		merged.push_back(group[0] + ".m");
+		if (!writer.open(merged.back()))
+			return false;
+		const bool good = mergeRunsAtOnce<SymCount>(group, [&writer](uint64_t key, uint32_t mask, const uint64_t* packed)
+		{
+			writer.write(key, mask, packed);
+		});
+		if (!writer.close() || !good)
+			return false;
+	}
+	return true;
+}
+
+
+
+template <size_t SymCount, typename Visitor>
+bool mergeRuns(const std::vector<std::string>& runs, Visitor visitor)
+{
+	std::vector<std::string> current(runs);
+	bool intermediate = false;  // current are runs of an earlier pass
+	while (current.size() > maxMergeFanIn)
+	{
+		std::vector<std::string> merged;
+		const bool good = mergeRunGroups<SymCount>(current, merged);
+		if (intermediate)
+			removeRuns(current);
+		current.swap(merged);
+		intermediate = true;
+		if (!good)
+		{
+			removeRuns(current);
+			return false;
+		}
+	}
+
+	const bool good = mergeRunsAtOnce<SymCount>(current, visitor);
+	if (intermediate)
+		removeRuns(current);
+	return good;
+}
+
+
+
+template <typename Table, typename Keep>
+bool writeMergedTable(const std::vector<std::string>& runs, const std::string& path, NgramFileFormat format, uint64_t budget, uint64_t& entries, Keep keep)
+{
+	const NgramFileFormat streamFormat = format == mappedFormat ? sparseFormat : format;
+	const std::string     streamPath   = format == mappedFormat ? path + ".sparse" : path;
+	entries = 0;
+	{
+		std::ofstream os(streamPath.c_str(), std::ios::binary | std::ios::trunc);
+		Table::writeHeader(os, 0, streamFormat);
+		BlockEncoder<Table::symbolCount> encoder;
+		if (!mergeRuns<Table::symbolCount>(runs, [&](uint64_t key, uint32_t mask, const uint64_t* packed)
+		{
+			if (!keep(key, mask, packed))
+				return;
+			++entries;
+			if (streamFormat != compressedFormat)
+			{
+				Table::writeEntry(os, key, mask, packed, streamFormat);
+				return;
+			}
+			encoder.add(key, mask, packed);
+			if (encoder.full())
+				encoder.write(os);
+		}))
+			return false;
+		encoder.write(os);
+
+		// the entry count is known now
+		os.seekp(0);
+		Table::writeHeader(os, entries, streamFormat);
+		if (!os)
+			return false;
+	}
+
+	if (format == mappedFormat)
+	{
+		const bool good = writeMappedTable<Table>(streamPath, path, budget);
+		std::remove(streamPath.c_str());
+		return good;
+	}
+	return true;
+}
+
+
+
+template <typename Table>
+bool writeMappedTable(const std::string& sparsePath, const std::string& path, uint64_t budget)
+{
+	static const size_t SymCount = Table::symbolCount;
+	typedef SparseCounts<SymCount, uint64_t> CountsType;
+
+	// entries sorted by hash
+	uint64_t entries = 0;
+	RunSpiller<SymCount> spiller(path + ".h", budget);
+	{
+		std::ifstream is(sparsePath.c_str(), std::ios::binary);
+		bool good = Table::readHeader(is, entries) == sparseFormat;
+		uint64_t key;
+		uint32_t mask;
+		uint64_t packed[SymCount+1];
+		for (uint64_t ii = 0; good && ii < entries; ++ii)
+		{
+			Table::readEntry(is, sparseFormat, key, mask, packed);
+			good = !is.fail();
+			if (good)
+				spiller.add(hashKey(key), mask, packed);
+		}
+		good = spiller.flush() && good;
+		if (!good)
+		{
+			removeRuns(spiller.runs());
+			return false;
+		}
+	}
+
+	uint64_t slotCount = 16;
+	unsigned int slotShift = 60;
+	while (slotCount < 2*entries)
+	{
+		slotCount *= 2;
+		--slotShift;
+	}
+
+	// header filled in at the end
+	std::ofstream os(path.c_str(), std::ios::binary | std::ios::trunc);
+	const std::vector<char> header(56, 0);
+	os.write(header.data(), header.size());
+
+	std::ofstream counterFiles[4];
+	for (unsigned int code = 0; code < 4; ++code)
+		counterFiles[code].open((path + ".c" + std::to_string(code)).c_str(), std::ios::binary | std::ios::trunc);
+
+	const size_t           maxWrapped = 1 << 16;
+	const NgramSlot        empty      = {~uint64_t(0), 0, 0};
+	uint64_t               counterCount[4] = {0, 0, 0, 0};
+	uint64_t               next = 0;    // slots written
+	std::vector<uint64_t>  firstEmpty;  // the first empty slots, taken by wrapped entries
+	std::vector<NgramSlot> wrapped;
+	bool                   full = false;
+	bool good = mergeRuns<SymCount>(spiller.runs(), [&](uint64_t hash, uint32_t mask, const uint64_t* packed)
+	{
+		const size_t       count = CountsType::width(mask)+1;
+		const unsigned int code  = CountsType::widthCode(packed[0]);
+		if (counterCount[code] + count > NgramSlot::indexLimit)
+		{
+			full = true;
+			return;
+		}
+		const NgramSlot slot = {unhashKey(hash), mask, uint32_t((code << 30) | counterCount[code])};
+		unsigned char counters[8*(SymCount+1)];
+		CountsType::narrow(packed, count, code, counters);
+		counterFiles[code].write((char*)counters, count << code);
+		counterCount[code] += count;
+
+		for (const uint64_t home = hash >> slotShift; next < home; ++next)
+		{
+			if (firstEmpty.size() < maxWrapped)
+				firstEmpty.push_back(next);
+			os.write((const char*)&empty, sizeof(NgramSlot));
+		}
+		if (next == slotCount)
+			wrapped.push_back(slot);
+		else
+		{
+			os.write((const char*)&slot, sizeof(NgramSlot));
+			++next;
+		}
+	});
+	removeRuns(spiller.runs());
+	for (; next < slotCount; ++next)
+	{
+		if (firstEmpty.size() < maxWrapped)
+			firstEmpty.push_back(next);
+		os.write((const char*)&empty, sizeof(NgramSlot));
+	}
+	if (full)
+		std::cerr << "Table too large for mappedFormat: more than 2^30 counters of one width." << std::endl;
+	good = good && !full && wrapped.size() <= firstEmpty.size();
+	for (size_t idx = 0; good && idx < wrapped.size(); ++idx)
+	{
+		os.seekp(header.size() + firstEmpty[idx]*sizeof(NgramSlot));
+		os.write((const char*)&wrapped[idx], sizeof(NgramSlot));
+	}
+
+	// counter arrays widest first, padding, then the header
+	os.seekp(0, std::ios::end);
+	uint64_t length = header.size() + slotCount*sizeof(NgramSlot);
+	for (unsigned int code = 4; code-- > 0; )
+	{
+		const std::string counterPath = path + ".c" + std::to_string(code);
+		good = counterFiles[code].good() && good;
+		counterFiles[code].close();
+		if (good && counterCount[code] > 0)
+		{
+			std::ifstream is(counterPath.c_str(), std::ios::binary);
+			os << is.rdbuf();
+			length += counterCount[code] << code;
+		}
+		std::remove(counterPath.c_str());
+	}
+	const uint64_t zero = 0;
+	os.write((const char*)&zero, (8 - length % 8) % 8);
+
+	const uint16_t padding = 0;
+	os.seekp(0);
+	Table::writeHeader(os, entries, mappedFormat);
+	os.write((const char*)&padding, 2);
+	os.write((const char*)&slotCount, 8);
+	os.write((const char*)counterCount, 4*8);
+	return good && os.good();
+}
+
+
+
+#endif
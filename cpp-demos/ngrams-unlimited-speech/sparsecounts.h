@@ -0,0 +1,450 @@
+/*
+ * Sparse storage of successor counts for N-gram prefixes.
+ */
+
+#ifndef SPARSECOUNTS_H
+#define SPARSECOUNTS_H
+
+#include <iostream>
+#include <vector>
+#include <limits>
+#include <type_traits>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Scale a uniform 64 bit word to [0, range) by a multiply-shift (Lemire's
+ * method without the rejection step), the bias is below range / 2^64.
+ * The low 64 bits of the product are uniform as well, see AliasSampler.
+ */
+inline uint64_t scaleRandom(uint64_t rand64, uint64_t range)
+{
+	return (unsigned __int128)rand64 * range >> 64;
+}
+
+
+/// uniform 64 bit word from a number in [0, 1), for the double based interfaces
+inline uint64_t randomWord(double rand01)
+{
+	return rand01 < 1.0 ? uint64_t(rand01 * 18446744073709551616.0) : ~uint64_t(0);
+}
+
+
+
+/**
+ * Draw a successor symbol proportionally to its count.
+ * packed: total count followed by the counts of the set mask bits.
+ * rand64: uniform random word
+ * Returns 255 for an empty mask.
+ */
+template <typename T>
+inline unsigned char sampleSuccessor(uint32_t mask, const T* packed, uint64_t rand64)
+{
+	uint64_t selval = scaleRandom(rand64, packed[0]);
+	size_t idx = 1;
+	for (uint32_t m = mask; m; m &= m-1, ++idx)
+	{
+		if (selval < packed[idx])
+			return __builtin_ctz(m);
+		else
+			selval -= packed[idx];
+	}
+
+	// else return last nonzero
+	if (mask)
+		return 31 - __builtin_clz(mask);
+
+	return 255;
+}
+
+
+
+/***
+ * Each prefix refers to a block holding its total count followed by the
+ * nonzero successor counts in symbol order, the symbols present are given
+ * by a bit mask. Blocks live in one pool per counter width and successor
+ * count and are recycled through free lists when a prefix gains a new
+ * successor.
+ *
+ * Counters start at 8 bits and the whole block of a prefix is promoted to
+ * 16, 32 and 64 bits (limited by Ctype) when its total would overflow.
+ * A pool holds at most 2^30 blocks (the index bits of Ref::block), the
+ * program is aborted with a message beyond that.
+ *
+ * SymCount: cardinality of symbol set (at most 32)
+ * Ctype:    widest counter type (unsigned integer type)
+ */
+template <size_t SymCount, typename Ctype>
+class SparseCounts
+{
+public:
+	static_assert(SymCount <= 32, "successor mask is 32 bits");
+	static_assert(std::is_unsigned<Ctype>::value, "counters are unsigned integers");
+
+	struct Ref
+	{
+		uint32_t mask;   ///< successor symbols present, 0 for a new prefix
+		uint32_t block;  ///< width code in the two top bits, block index in its pool below
+	};
+
+	inline void get(const Ref& ref, Ctype* packed) const;              ///< total and nonzero successor counts, width(mask)+1 values
+	inline void add(Ref& ref, size_t sym, Ctype count = 1);            ///< add count to one successor
+	void add(Ref& ref, uint32_t mask, const Ctype* packed);             ///< add counts in get() layout
+	void expand(const Ref& ref, Ctype counts[SymCount+1]) const;        ///< full array, zeroth index total
+	static void pack(const Ctype counts[SymCount+1], uint32_t& mask, Ctype* packed); ///< inverse of expand
+	void clear();          ///< drop all blocks and release their memory, references become invalid
+
+	/// append blocks[code][successors] blocks to the pool of each width code and successor count, first[code][successors] is set to the index of the first
+	void grow(const uint64_t blocks[4][SymCount+1], uint32_t first[4][SymCount+1]);
+	/// store counts in get() layout to the (grown) block of ref as is, blocks may be set on several threads at once
+	void set(const Ref& ref, const Ctype* packed) { store(ref, packed); };
+	uint64_t bytes() const; ///< memory allocated for counter blocks
+
+	static inline size_t       width(uint32_t mask) { return __builtin_popcount(mask); };
+	static inline unsigned int widthCode(const Ref& ref) { return ref.block >> 30; }; ///< counters are 1 << code bytes
+	static inline unsigned int widthCode(Ctype total);                                ///< smallest code holding total
+
+	/// store count values as 1 << code byte counters at out (native byte order)
+	static void narrow(const Ctype* packed, size_t count, unsigned int code, unsigned char* out);
+	/// inverse of narrow
+	static void widen(const unsigned char* in, size_t count, unsigned int code, Ctype* packed);
+
+private:
+	std::vector<uint8_t>  pool8[SymCount+1];
+	std::vector<uint16_t> pool16[SymCount+1];
+	std::vector<uint32_t> pool32[SymCount+1];
+	std::vector<uint64_t> pool64[SymCount+1];
+	std::vector<uint32_t> freeBlocks[4][SymCount+1];
+
+	static const uint32_t indexMask = (uint32_t(1) << 30) - 1;
+
+	template <typename T>
+	static inline T* blockData(const std::vector<T>* pools, const Ref& ref)
+	{
+		const size_t successors = width(ref.mask);
+		return const_cast<T*>(&pools[successors][(ref.block & indexMask)*(successors+1)]);
+	};
+
+	template <typename T>
+	static inline bool increment(std::vector<T>* pools, const Ref& ref, size_t idx, Ctype count);
+
+	void     store(const Ref& ref, const Ctype* packed);
+	uint32_t allocate(unsigned int code, size_t successors);
+	void     release(const Ref& ref);
+
+	/// blocks of one pool exceed indexMask
+	static void poolFull(unsigned int code, size_t successors)
+	{
+		std::cerr << "Counter pool full: more than 2^30 blocks of " << (8 << code) << " bit counters with " << successors << " successors." << std::endl;
+		std::abort();
+	};
+};
+
+
+
+
+template <size_t SymCount, typename Ctype>
+void SparseCounts<SymCount, Ctype>::
+get(const Ref& ref, Ctype* packed) const
+{
+	const size_t count = width(ref.mask)+1;
+	switch (widthCode(ref))
+	{
+	case 0: { const uint8_t*  src = blockData(pool8, ref);  for (size_t ii = 0; ii < count; ++ii) packed[ii] = src[ii]; break; }
+	case 1: { const uint16_t* src = blockData(pool16, ref); for (size_t ii = 0; ii < count; ++ii) packed[ii] = src[ii]; break; }
+	case 2: { const uint32_t* src = blockData(pool32, ref); for (size_t ii = 0; ii < count; ++ii) packed[ii] = src[ii]; break; }
+	case 3: { const uint64_t* src = blockData(pool64, ref); for (size_t ii = 0; ii < count; ++ii) packed[ii] = src[ii]; break; }
+	}
+}
+
+
+
+template <size_t SymCount, typename Ctype>
+void SparseCounts<SymCount, Ctype>::
+add(Ref& ref, size_t sym, Ctype count)
+{
+	const uint32_t bit = uint32_t(1) << sym;
+	if (ref.mask & bit)
+	{
+		const size_t idx = 1 + width(ref.mask & (bit-1));
+		bool done = false;
+		switch (widthCode(ref))
+		{
+		case 0: done = increment(pool8, ref, idx, count); break;
+		case 1: done = increment(pool16, ref, idx, count); break;
+		case 2: done = increment(pool32, ref, idx, count); break;
+		case 3: done = increment(pool64, ref, idx, count); break;
+		}
+		if (done)
+			return;
+	}
+
+	Ctype packed[2] = {count, count};
+	add(ref, bit, packed);
+}
+
+
+
+template <size_t SymCount, typename Ctype>
+void SparseCounts<SymCount, Ctype>::
+add(Ref& ref, uint32_t mask, const Ctype* packed)
+{
+	if (!mask)
+		return;
+
+	Ctype current[SymCount+1];
+	if (ref.mask)
+		get(ref, current);
+	else
+		current[0] = 0;
+
+	// merge present and added successors
+	const uint32_t newMask = ref.mask | mask;
+	Ctype merged[SymCount+1];
+	merged[0] = current[0] + packed[0];
+	size_t curIdx = 1;
+	size_t addIdx = 1;
+	size_t dstIdx = 1;
+	for (uint32_t m = newMask; m; m &= m-1, ++dstIdx)
+	{
+		const uint32_t bit = m & -m;
+		merged[dstIdx] = 0;
+		if (ref.mask & bit) merged[dstIdx] += current[curIdx++];
+		if (mask & bit)     merged[dstIdx] += packed[addIdx++];
+	}
+
+	// totals only grow, so the width code never shrinks
+	const unsigned int code = widthCode(merged[0]);
+	if (ref.mask && newMask == ref.mask && code == widthCode(ref))
+	{
+		store(ref, merged);
+		return;
+	}
+
+	Ref newRef = {newMask, (code << 30) | allocate(code, width(newMask))};
+	store(newRef, merged);
+	if (ref.mask)
+		release(ref);
+	ref = newRef;
+}
+
+
+
+template <size_t SymCount, typename Ctype>
+void SparseCounts<SymCount, Ctype>::
+expand(const Ref& ref, Ctype counts[SymCount+1]) const
+{
+	for (size_t ii = 0; ii < SymCount+1; ++ii)
+		counts[ii] = 0;
+	if (!ref.mask)
+		return;
+
+	Ctype packed[SymCount+1];
+	get(ref, packed);
+	counts[0] = packed[0];
+	size_t idx = 1;
+	for (uint32_t m = ref.mask; m; m &= m-1)
+		counts[1 + __builtin_ctz(m)] = packed[idx++];
+}
+
+
+
+template <size_t SymCount, typename Ctype>
+void SparseCounts<SymCount, Ctype>::
+pack(const Ctype counts[SymCount+1], uint32_t& mask, Ctype* packed)
+{
+	mask = 0;
+	packed[0] = counts[0];
+	size_t idx = 1;
+	for (size_t ii = 0; ii < SymCount; ++ii)
+	{
+		if (counts[ii+1] != 0)
+		{
+			mask |= uint32_t(1) << ii;
+			packed[idx++] = counts[ii+1];
+		}
+	}
+}
+
+
+
+template <size_t SymCount, typename Ctype>
+unsigned int SparseCounts<SymCount, Ctype>::
+widthCode(Ctype total)
+{
+	if (total <= 0xff)       return 0;
+	if (total <= 0xffff)     return 1;
+	if (total <= 0xffffffff) return 2;
+	return 3;
+}
+
+
+
+template <size_t SymCount, typename Ctype>
+void SparseCounts<SymCount, Ctype>::
+narrow(const Ctype* packed, size_t count, unsigned int code, unsigned char* out)
+{
+	for (size_t ii = 0; ii < count; ++ii)
+	{
+		switch (code)
+		{
+		case 0: { uint8_t  val = packed[ii]; std::memcpy(out, &val, 1); break; }
+		case 1: { uint16_t val = packed[ii]; std::memcpy(out, &val, 2); break; }
+		case 2: { uint32_t val = packed[ii]; std::memcpy(out, &val, 4); break; }
+		case 3: { uint64_t val = packed[ii]; std::memcpy(out, &val, 8); break; }
+		}
+		out += 1 << code;
+	}
+}
+
+
+
+template <size_t SymCount, typename Ctype>
+void SparseCounts<SymCount, Ctype>::
+widen(const unsigned char* in, size_t count, unsigned int code, Ctype* packed)
+{
+	for (size_t ii = 0; ii < count; ++ii)
+	{
+		switch (code)
+		{
+		case 0: { uint8_t  val; std::memcpy(&val, in, 1); packed[ii] = val; break; }
+		case 1: { uint16_t val; std::memcpy(&val, in, 2); packed[ii] = val; break; }
+		case 2: { uint32_t val; std::memcpy(&val, in, 4); packed[ii] = val; break; }
+		case 3: { uint64_t val; std::memcpy(&val, in, 8); packed[ii] = val; break; }
+		}
+		in += 1 << code;
+	}
+}
+
+
+
+template <size_t SymCount, typename Ctype>
+template <typename T>
+bool SparseCounts<SymCount, Ctype>::
+increment(std::vector<T>* pools, const Ref& ref, size_t idx, Ctype count)
+{
+	T* counts = blockData(pools, ref);
+	if (Ctype(std::numeric_limits<T>::max() - counts[0]) < count)
+		return false;
+
+	counts[0] += count;
+	counts[idx] += count;
+	return true;
+}
+
+
+
+template <size_t SymCount, typename Ctype>
+void SparseCounts<SymCount, Ctype>::
+store(const Ref& ref, const Ctype* packed)
+{
+	const size_t count = width(ref.mask)+1;
+	switch (widthCode(ref))
+	{
+	case 0: { uint8_t*  dst = blockData(pool8, ref);  for (size_t ii = 0; ii < count; ++ii) dst[ii] = packed[ii]; break; }
+	case 1: { uint16_t* dst = blockData(pool16, ref); for (size_t ii = 0; ii < count; ++ii) dst[ii] = packed[ii]; break; }
+	case 2: { uint32_t* dst = blockData(pool32, ref); for (size_t ii = 0; ii < count; ++ii) dst[ii] = packed[ii]; break; }
+	case 3: { uint64_t* dst = blockData(pool64, ref); for (size_t ii = 0; ii < count; ++ii) dst[ii] = packed[ii]; break; }
+	}
+}
+
+
+
+template <size_t SymCount, typename Ctype>
+void SparseCounts<SymCount, Ctype>::
+clear()
+{
+	for (size_t successors = 0; successors < SymCount+1; ++successors)
+	{
+		std::vector<uint8_t>().swap(pool8[successors]);
+		std::vector<uint16_t>().swap(pool16[successors]);
+		std::vector<uint32_t>().swap(pool32[successors]);
+		std::vector<uint64_t>().swap(pool64[successors]);
+		for (unsigned int code = 0; code < 4; ++code)
+			std::vector<uint32_t>().swap(freeBlocks[code][successors]);
+	}
+}
+
+
+
+template <size_t SymCount, typename Ctype>
+void SparseCounts<SymCount, Ctype>::
+grow(const uint64_t blocks[4][SymCount+1], uint32_t first[4][SymCount+1])
+{
+	for (size_t successors = 0; successors < SymCount+1; ++successors)
+	{
+		const size_t blockLen = successors+1;
+		for (unsigned int code = 0; code < 4; ++code)
+		{
+			const size_t used = code == 0 ? pool8[successors].size() : code == 1 ? pool16[successors].size() : code == 2 ? pool32[successors].size() : pool64[successors].size();
+			if (used / blockLen + blocks[code][successors] > uint64_t(indexMask)+1)
+				poolFull(code, successors);
+		}
+		first[0][successors] = pool8[successors].size() / blockLen;
+		first[1][successors] = pool16[successors].size() / blockLen;
+		first[2][successors] = pool32[successors].size() / blockLen;
+		first[3][successors] = pool64[successors].size() / blockLen;
+		pool8[successors].resize(pool8[successors].size() + blocks[0][successors]*blockLen);
+		pool16[successors].resize(pool16[successors].size() + blocks[1][successors]*blockLen);
+		pool32[successors].resize(pool32[successors].size() + blocks[2][successors]*blockLen);
+		pool64[successors].resize(pool64[successors].size() + blocks[3][successors]*blockLen);
+	}
+}
+
+
+
+template <size_t SymCount, typename Ctype>
+uint64_t SparseCounts<SymCount, Ctype>::
+bytes() const
+{
+	uint64_t total = 0;
+	for (size_t successors = 0; successors < SymCount+1; ++successors)
+	{
+		total += pool8[successors].capacity() + pool16[successors].capacity()*2 + pool32[successors].capacity()*4 + pool64[successors].capacity()*8;
+		for (unsigned int code = 0; code < 4; ++code)
+			total += freeBlocks[code][successors].capacity()*4;
+	}
+	return total;
+}
+
+
+
+template <size_t SymCount, typename Ctype>
+uint32_t SparseCounts<SymCount, Ctype>::
+allocate(unsigned int code, size_t successors)
+{
+	std::vector<uint32_t>& freeList = freeBlocks[code][successors];
+	if (!freeList.empty())
+	{
+		const uint32_t block = freeList.back();
+		freeList.pop_back();
+		return block;
+	}
+
+	size_t blocks = 0;
+	switch (code)
+	{
+	case 0: blocks = pool8[successors].size();  pool8[successors].resize(blocks + successors+1);  break;
+	case 1: blocks = pool16[successors].size(); pool16[successors].resize(blocks + successors+1); break;
+	case 2: blocks = pool32[successors].size(); pool32[successors].resize(blocks + successors+1); break;
+	case 3: blocks = pool64[successors].size(); pool64[successors].resize(blocks + successors+1); break;
+	}
+	if (blocks / (successors+1) > indexMask)
+		poolFull(code, successors);
+	return blocks / (successors+1);
+}
+
+
+
+template <size_t SymCount, typename Ctype>
+void SparseCounts<SymCount, Ctype>::
+release(const Ref& ref)
+{
+	freeBlocks[widthCode(ref)][width(ref.mask)].push_back(ref.block & indexMask);
+}
+
+
+
+#endif
@@ -1,10 +1,27 @@
 #include "../ngram.h"
+#include "../ngramview.h"
+#include "../lazyngram.h"
+#include "../mappedfile.h"
+#include "../modelindex.h"
+#include "../contexttrie.h"
+#include "../transitionautomaton.h"
+#include "../parallelfor.h"
+#include "../randomwords.h"
 #include "speak.h"
+#include "textwriter.h"
+#include "speechpipeline.h"
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <chrono>
 #include <random>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
 
 
 const size_t Symbols = 29; // 26+1+2
@@ -14,27 +31,617 @@ const size_t SymbolBits = 6; // OK up to 32 symbols
 
 void helptext(const char* progname, unsigned int Nmaxmax)
 {
-	std::cerr << "Usage: " << progname << " <input N-gram file> <output generated file>|speak <N-max> <output size>" << std::endl;
+	std::cerr << "Usage: " << progname << " <input N-gram file> <output generated file>|-|speak <N-max> <output size> [options]" << std::endl;
+	std::cerr << "Output - writes the text to stdout (messages go to stderr)." << std::endl;
 	std::cerr << "N-max 1-" << Nmaxmax << "\n" << std::endl;
+	std::cerr << "Options:" << std::endl;
+	std::cerr << "  -a  sample through alias tables built after loading (constant time per character)" << std::endl;
+	std::cerr << "  -c  generate from a context trie of all orders built after loading (no hashing)" << std::endl;
+	std::cerr << "  -x  compile the context trie into a transition automaton (alias sampling, no lookups at all)" << std::endl;
+	std::cerr << "  -s <streams>  generate independent streams, each of output size, to <output>.0, <output>.1, ..." << std::endl;
+	std::cerr << "  -t <threads>  threads running the streams (default one per stream)" << std::endl;
+	std::cerr << "  -i            write the streams interleaved in chunks to the one output file" << std::endl;
+	std::cerr << "  -r <seed>     random seed, for reproducible runs (default from the clock)" << std::endl;
+	std::cerr << "  -g <engine>   random number generator, xoshiro (xoshiro256**, default) or std (std::default_random_engine)" << std::endl;
+	std::cerr << "  -m            write output files through a memory mapping pre-sized to the output size" << std::endl;
+	std::cerr << "  -w            render output size characters as speech to the output WAV file (no audio device)" << std::endl;
+	std::cerr << "  -o <orders>   load only these orders (comma separated, of an indexed model), backing off past the others" << std::endl;
+	std::cerr << "  -l <N-low>    load orders up to N-low at start, higher ones piecewise on first use (indexed model, not with -a, -c, -x)\n" << std::endl;
 }
 
 
 template <unsigned int N>
-void loadNgrams(Ngram<N, Symbols, SymbolBits>& ngram, std::istream& is, const unsigned int Nmax)
+void loadNgrams(Ngram<N, Symbols, SymbolBits>& ngram, std::istream& is, const unsigned int Nmax, unsigned int threadCount)
 {
 	if (N <= Nmax)
 	{
 		std::cout << "Loading " << N << "-grams..." << std::flush;
-		uint64_t entries = ngram.read(is);
+		uint64_t entries = ngram.read(is, threadCount);
 		std::cout << " " << entries << " entries loaded." << std::endl;
 	}
 }
 
 
+template <unsigned int N>
+bool viewNgrams(NgramView<N, Symbols, SymbolBits>& ngram, const unsigned char*& data, const unsigned char* end, const unsigned int Nmax)
+{
+	if (N <= Nmax)
+	{
+		uint64_t length = ngram.view(data, end-data);
+		if (length == 0)
+		{
+			std::cerr << "No mapped " << N << "-gram table found." << std::endl;
+			return false;
+		}
+		data += length;
+		std::cout << "Mapped " << N << "-grams, " << ngram.size() << " entries." << std::endl;
+	}
+	return true;
+}
+
+
+
+/// load one order from its section of a model file in memory on up to threadCount threads, see ModelIndex
+template <unsigned int N>
+bool readSection(Ngram<N, Symbols, SymbolBits>& ngram, const unsigned char* file, const ModelSection& section, unsigned int threadCount)
+{
+	MemoryBuf buf(file + section.offset, section.length);
+	std::istream is(&buf);
+	return ngram.read(is, threadCount) == section.entries && is;
+}
+
+
+/// use one order in place from its section of a mapped model file, see ModelIndex
+template <unsigned int N>
+bool readSection(NgramView<N, Symbols, SymbolBits>& ngram, const unsigned char* file, const ModelSection& section, unsigned int)
+{
+	return ngram.view(file + section.offset, section.length) > 0;
+}
+
+
+/// load one order whole from its section of a model file in memory, see LazyNgram
+template <unsigned int N>
+bool readSection(LazyNgram<N, Symbols, SymbolBits>& ngram, const unsigned char* file, const ModelSection& section, unsigned int threadCount)
+{
+	return ngram.load(file + section.offset, section.length, section.entries, threadCount);
+}
+
+
+/// an Ngram table is loaded right away
+template <unsigned int N>
+bool pageSection(Ngram<N, Symbols, SymbolBits>& ngram, const unsigned char* file, const ModelSection& section)
+{
+	return readSection<N>(ngram, file, section, 1);
+}
+
+
+/// a view is paged in by the operating system as it is used
+template <unsigned int N>
+bool pageSection(NgramView<N, Symbols, SymbolBits>& ngram, const unsigned char* file, const ModelSection& section)
+{
+	return readSection<N>(ngram, file, section, 1);
+}
+
+
+/// decode one order from its section of a model file in memory as it is used, see LazyNgram
+template <unsigned int N>
+bool pageSection(LazyNgram<N, Symbols, SymbolBits>& ngram, const unsigned char* file, const ModelSection& section)
+{
+	return ngram.page(file + section.offset, section.length) && ngram.size() == section.entries;
+}
+
+
+
+/***
+ * Tables for orders 1..N, queried by order at run time.
+ * Table: Ngram (loaded from a stream), NgramView (mapped model file) or
+ *        LazyNgram (model file in memory, orders loaded on demand)
+ */
+template <template <size_t, size_t, size_t, typename> class Table, unsigned int N>
+class NgramModel : public NgramModel<Table, N-1>
+{
+public:
+	/// return 255 if no matching ngram (or order out of range)
+	unsigned char getChar(unsigned int order, const ContextKey<SymbolBits>& ngram, uint64_t rand64) const
+	{
+		if (order == N)
+			return table.getChar(ngram, rand64);
+		return NgramModel<Table, N-1>::getChar(order, ngram, rand64);
+	};
+
+	/// generation state, the order to try first and the history
+	struct State
+	{
+		unsigned int           order;
+		unsigned int           maxOrder;
+		ContextKey<SymbolBits> history;
+	};
+
+	/// history of one space, orders up to maxOrder
+	State start(unsigned int maxOrder) const
+	{
+		State state = {0, maxOrder, ContextKey<SymbolBits>()};
+		push(state, 0);
+		return state;
+	};
+
+	/// draw from the longest order having the prefix, backing off, return 255 (order 0) if none
+	unsigned char getChar(State& state, uint64_t rand64) const
+	{
+		for (; state.order > 0; --state.order)
+		{
+			const unsigned char gen = getChar(state.order, state.history, rand64);
+			if (gen != 255)
+				return gen;
+		}
+		return 255;
+	};
+
+	/// append a symbol, the next draw may use one more symbol than the last
+	void push(State& state, unsigned char sym) const
+	{
+		state.history.push(sym);
+		if (state.order < state.maxOrder)
+			++state.order;
+	};
+
+	/// visit the table of one order, see Ngram::visit
+	template <typename Visitor>
+	void visit(unsigned int order, Visitor visitor) const
+	{
+		if (order == N)
+			table.visit(visitor);
+		else
+			NgramModel<Table, N-1>::visit(order, visitor);
+	};
+
+	/// load orders up to Nmax, lowest first, each on up to threadCount threads (Ngram tables)
+	void load(std::istream& is, const unsigned int Nmax, unsigned int threadCount)
+	{
+		NgramModel<Table, N-1>::load(is, Nmax, threadCount);
+		loadNgrams<N>(table, is, Nmax, threadCount);
+	};
+
+	/// use orders up to Nmax from mapped data, lowest first (NgramView tables)
+	bool view(const unsigned char*& data, const unsigned char* end, const unsigned int Nmax)
+	{
+		return NgramModel<Table, N-1>::view(data, end, Nmax) && viewNgrams<N>(table, data, end, Nmax);
+	};
+
+	/// load (or view) one order from its section of an indexed model file, see readSection
+	bool loadSection(unsigned int order, const unsigned char* file, const ModelSection& section, unsigned int threadCount)
+	{
+		if (order == N)
+			return readSection<N>(table, file, section, threadCount);
+		return NgramModel<Table, N-1>::loadSection(order, file, section, threadCount);
+	};
+
+	/// use one order from its section of an indexed model file, loaded as it is queried, see pageSection
+	bool pageSection(unsigned int order, const unsigned char* file, const ModelSection& section)
+	{
+		if (order == N)
+			return ::pageSection<N>(table, file, section);
+		return NgramModel<Table, N-1>::pageSection(order, file, section);
+	};
+
+	/// pieces of one order decoded so far and in all (LazyNgram tables), false if a corrupt one was found
+	bool paging(unsigned int order, uint64_t& pagedIn, uint64_t& pieces) const
+	{
+		if (order != N)
+			return NgramModel<Table, N-1>::paging(order, pagedIn, pieces);
+		pagedIn = table.pagedIn();
+		pieces  = table.pieces();
+		return !table.failed();
+	};
+
+	/// build alias sampling tables for all orders
+	void freeze()
+	{
+		NgramModel<Table, N-1>::freeze();
+		table.freeze();
+	};
+
+private:
+	Table<N, Symbols, SymbolBits, uint64_t> table;
+};
+
+
+template <template <size_t, size_t, size_t, typename> class Table>
+class NgramModel<Table, 0>
+{
+public:
+	unsigned char getChar(unsigned int, const ContextKey<SymbolBits>&, uint64_t) const { return 255; };
+	void load(std::istream&, const unsigned int, unsigned int) { };
+	bool view(const unsigned char*&, const unsigned char*, const unsigned int) { return true; };
+	bool loadSection(unsigned int, const unsigned char*, const ModelSection&, unsigned int) { return false; };
+	bool pageSection(unsigned int, const unsigned char*, const ModelSection&) { return false; };
+	bool paging(unsigned int, uint64_t& pagedIn, uint64_t& pieces) const { pagedIn = pieces = 0; return true; };
+	void freeze() { };
+	template <typename Visitor>
+	void visit(unsigned int, Visitor) const { };
+};
+
+
+
+/**
+ * Load (or view, for a mappedFormat model) the orders up to Nmax selected
+ * in useOrder from an indexed model file, all orders in parallel, once
+ * the file is found to hold them with matching checksums. Each order gets
+ * a share of the threads by its size for decoding its blocks.
+ * A viewing model (inPlace) uses file in place, its mappedFormat tables
+ * are not checksummed since that would read the whole file at start; the
+ * view checks their slots against the counter arrays instead.
+ * Orders from lazyFrom on are only paged (see pageSection) and have their
+ * tables read as generation gets to them, so their checksums are not
+ * compared either; file must then outlive the model.
+ */
+template <typename Model>
+bool loadIndexed(Model& model, const MappedFile& file, const ModelIndex& index, const unsigned int Nmax, const std::vector<bool>& useOrder, const unsigned int lazyFrom, const bool inPlace)
+{
+	if (!file.good() || !index.fits(Nmax, file.size()))
+	{
+		std::cerr << "Model file is truncated or has no orders up to " << Nmax << "." << std::endl;
+		return false;
+	}
+
+	std::vector<unsigned int> orders;
+	std::vector<unsigned int> lazyOrders;
+	for (unsigned int order = 1; order <= Nmax; ++order)
+		if (useOrder[order])
+			(order < lazyFrom ? orders : lazyOrders).push_back(order);
+	std::vector<unsigned int> checked;
+	for (size_t idx = 0; idx < orders.size(); ++idx)
+		if (!inPlace || index.section(orders[idx]).format != mappedFormat)
+			checked.push_back(orders[idx]);
+	const unsigned int threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+	std::atomic<bool> failed(false);
+	if (!checked.empty())
+	{
+		std::cout << "Checking " << checked.size() << " orders..." << std::flush;
+		parallelFor(checked.size(), threadCount, [&](size_t task)
+		{
+			if (!index.verify(file.data(), checked[task]))
+				failed = true;
+		});
+		if (failed)
+		{
+			std::cerr << std::endl << "Model file is corrupt (checksum mismatch)." << std::endl;
+			return false;
+		}
+		std::cout << " ";
+	}
+
+	std::cout << "Loading..." << std::flush;
+	uint64_t totalLength = 0;
+	for (size_t idx = 0; idx < orders.size(); ++idx)
+		totalLength += index.section(orders[idx]).length;
+	parallelFor(orders.size(), threadCount, [&](size_t task)
+	{
+		const ModelSection& section = index.section(orders[task]);
+		const unsigned int  threads = std::max<uint64_t>(1, threadCount * section.length / std::max<uint64_t>(1, totalLength));
+		if (!model.loadSection(orders[task], file.data(), section, threads))
+			failed = true;
+	});
+	for (size_t idx = 0; idx < lazyOrders.size() && !failed; ++idx)
+		failed = !model.pageSection(lazyOrders[idx], file.data(), index.section(lazyOrders[idx]));
+	if (failed)
+	{
+		std::cerr << std::endl << "Model file holds no matching tables." << std::endl;
+		return false;
+	}
+	std::cout << " done." << std::endl;
+	for (size_t idx = 0; idx < orders.size(); ++idx)
+		std::cout << orders[idx] << "-grams: " << index.section(orders[idx]).entries << " entries." << std::endl;
+	for (size_t idx = 0; idx < lazyOrders.size(); ++idx)
+		std::cout << lazyOrders[idx] << "-grams: " << index.section(lazyOrders[idx]).entries << " entries, read as used." << std::endl;
+	return true;
+}
+
+
+
+template <typename Model>
+bool buildTrie(ContextTrie<Symbols, SymbolBits>& trie, const Model& model, const unsigned int Nmax)
+{
+	std::cout << "Building context trie..." << std::flush;
+	if (!trie.build(model, Nmax))
+	{
+		std::cerr << std::endl << "Model too large for a context trie (more than 2^30 counters of one width)." << std::endl;
+		return false;
+	}
+	std::cout << " " << trie.size() << " nodes, " << trie.bytes()/1024 << " kB." << std::endl;
+	return true;
+}
+
+
+
+/// random numbers and independent streams (see generateStreams)
+struct GenerateSettings
+{
+	uint64_t     seed;
+	bool         stdRandom;   ///< std::default_random_engine instead of xoshiro256**
+	unsigned int streams;
+	unsigned int threadCount;
+	bool         interleave;  ///< chunks of all streams in turn in one file, else one file per stream
+	const char*  outfile;
+	bool         mapOutput;   ///< write files through a pre-sized mapping (see TextWriter)
+	std::chrono::steady_clock::time_point started;  ///< program start, for the time to the first character
+};
+
+
+
+/// seconds since start
+inline double secondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+
+/// print the resident memory of the process, now and at its peak (from /proc, nothing where there is none)
+void reportMemory()
+{
+	std::ifstream status("/proc/self/status");
+	std::string   line;
+	uint64_t      resident = 0;
+	uint64_t      peak = 0;
+	while (std::getline(status, line))
+	{
+		if (line.compare(0, 6, "VmRSS:") == 0)
+			std::istringstream(line.substr(6)) >> resident;
+		else if (line.compare(0, 6, "VmHWM:") == 0)
+			std::istringstream(line.substr(6)) >> peak;
+	}
+	if (resident > 0)
+		std::cout << "Resident memory " << resident/1024 << " MB, peak " << peak/1024 << " MB." << std::endl;
+}
+
+
+
+/**
+ * Draw the next character, restarting from a space (counted in restarts)
+ * when nothing matches the history. Return 255 if the model has no
+ * character to start with. Prints nothing, so streams can share stdout.
+ */
+template <typename Model>
+inline unsigned char nextChar(const Model& model, typename Model::State& state, unsigned char& last, uint64_t rand64, uint64_t& restarts)
+{
+	unsigned char gen = model.getChar(state, rand64);
+	if (gen == 255)
+	{
+		if (last == 0)
+			return 255;
+		++restarts;
+		gen = 0;
+	}
+	model.push(state, gen);
+	last = gen;
+	return gen;
+}
+
+
+
+/**
+ * Generate settings.streams texts of outputSize characters on up to
+ * settings.threadCount threads sharing the model, each stream with its
+ * own random number generator. Interleaved output holds chunk c of
+ * stream k at chunk index c*streams + k.
+ */
+template <typename Random, typename Model>
+int generateStreams(const Model& model, const unsigned int Nmax, const uint64_t outputSize, const GenerateSettings& settings, const char* revCodeLUT)
+{
+	std::cout << "Generating " << settings.streams << " streams of " << outputSize << " characters using "
+		<< std::min(settings.streams, settings.threadCount) << " threads..." << std::flush;
+	const auto startTime = std::chrono::steady_clock::now();
+
+	int fd = -1;
+	if (settings.interleave)
+	{
+		fd = open(settings.outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+		{
+			std::cerr << "Could not open output file: " << settings.outfile << std::endl;
+			return 1;
+		}
+	}
+
+	const size_t          chunkSize = 1 << 16;
+	std::atomic<bool>     failed(false);
+	std::atomic<bool>     noStart(false);
+	std::atomic<bool>     firstDone(false);
+	double                firstSeconds = 0;
+	std::vector<uint64_t> restarts(settings.streams, 0);  // reported after all streams are done
+	parallelFor(settings.streams, settings.threadCount, [&](size_t stream)
+	{
+		Random random(settings.seed, stream);
+		const auto firstChar = [&]()
+		{
+			if (!firstDone.exchange(true))
+				firstSeconds = secondsSince(settings.started);
+		};
+
+		TextWriter out;
+		if (!settings.interleave)
+		{
+			std::ostringstream name;
+			name << settings.outfile << "." << stream;
+			if (!out.open(name.str().c_str(), settings.mapOutput ? outputSize : 0))
+			{
+				std::cerr << "Could not open output file: " << name.str() << std::endl;
+				failed = true;
+				return;
+			}
+		}
+
+		typename Model::State state = model.start(Nmax);
+		unsigned char last = 0;  // start from a space (not written)
+		if (!settings.interleave)
+		{
+			for (uint64_t chout = 0; chout < outputSize; ++chout)
+			{
+				const unsigned char gen = nextChar(model, state, last, random(), restarts[stream]);
+				if (gen == 255)
+				{
+					noStart = true;
+					break;
+				}
+				if (chout == 0)
+					firstChar();
+				out.put(revCodeLUT[gen]);
+			}
+			if (!out.close() || last == 0)
+				failed = true;
+			return;
+		}
+
+		std::vector<char> chunk(chunkSize);
+		for (uint64_t done = 0; done < outputSize && !failed; done += chunk.size())
+		{
+			chunk.resize(std::min<uint64_t>(chunkSize, outputSize - done));
+			for (size_t ii = 0; ii < chunk.size(); ++ii)
+			{
+				const unsigned char gen = nextChar(model, state, last, random(), restarts[stream]);
+				if (gen == 255)
+				{
+					noStart = true;
+					failed = true;
+					return;
+				}
+				if (done == 0 && ii == 0)
+					firstChar();
+				chunk[ii] = revCodeLUT[gen];
+			}
+
+			const uint64_t offset = done*settings.streams + stream*chunk.size();
+			if (pwrite(fd, chunk.data(), chunk.size(), offset) != ssize_t(chunk.size()))
+				failed = true;
+		}
+	});
+
+	if (fd >= 0)
+		close(fd);
+	if (noStart)
+		std::cout << std::endl << "No character to start with!" << std::endl;
+	if (failed)
+		return 1;
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	std::cout << " done in " << seconds << " s, " << settings.streams*outputSize / seconds / 1e6 << " M characters/s." << std::endl;
+	std::cout << "First character after " << firstSeconds << " s." << std::endl;
+	for (unsigned int stream = 0; stream < settings.streams; ++stream)
+	{
+		if (restarts[stream] > 0)
+			std::cout << "Stream " << stream << ": restarted from space " << restarts[stream] << " times, nothing matched the history." << std::endl;
+	}
+	return 0;
+}
+
+
+
+/**
+ * Generate outputSize characters (endless when speaking, unless rendering
+ * speech to a file) from the model, backing off to shorter histories when
+ * the longer one is missing.
+ * Model: NgramModel, ContextTrie or TransitionAutomaton
+ * Random: Xoshiro256 or StdRandom
+ */
+template <typename Random, typename Model>
+int generateText(const Model& model, const unsigned int Nmax, const uint64_t outputSize, eSpeak* speaker, TextWriter& out, const char* revCodeLUT, const GenerateSettings& settings)
+{
+	const bool doSpeak = speaker != 0;
+	WavWriter* wav = doSpeak ? speaker->renderTarget() : 0;
+	std::cout << "Generating " << outputSize << " character text:" << std::endl;
+
+	Random random(settings.seed);
+
+	// sentences are spoken on their own thread while the next ones are generated
+	const size_t maxSentence = 10000;
+	std::string sentence;
+	std::unique_ptr<SpeechPipeline> pipeline;
+	if (doSpeak)
+		pipeline.reset(wav ? new SpeechPipeline(*speaker, "", false) : new SpeechPipeline(*speaker, "Hello!"));
+	const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+	typename Model::State state = model.start(Nmax);
+	unsigned char last = 0;  // start from a space (not written)
+	uint64_t restarts = 0;
+
+	for (uint64_t chout = 0; (doSpeak && !wav) || chout < outputSize; ++chout)
+	{
+		const uint64_t restarted = restarts;
+		const unsigned char gen = nextChar(model, state, last, random(), restarts);
+		if (gen == 255)
+		{
+			std::cout << "No character to start with!" << std::endl;
+			return 1;
+		}
+		if (restarts != restarted)
+			std::cout << "Error while generating, restarting from space" << std::endl;
+		if (chout == 0)
+			std::cout << "First character after " << secondsSince(settings.started) << " s." << std::endl;
+		if (doSpeak)
+		{
+			sentence += revCodeLUT[gen];
+			if (sentence.back() == '.' || sentence.size() == maxSentence)
+			{
+				pipeline->push(sentence);
+				sentence.clear();
+			}
+		}
+		else
+		{
+			out.put(revCodeLUT[gen]);
+		}
+	}
+
+	if (wav)
+	{
+		if (!sentence.empty())
+			pipeline->push(sentence);
+		pipeline.reset();
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		const double audio   = double(wav->samples()) / wav->sampleRate();
+		std::cout << "Rendered " << audio << " s of speech in " << seconds << " s (" << audio / seconds << " times real time)." << std::endl;
+		if (!wav->close())
+		{
+			std::cerr << "Could not write WAV file." << std::endl;
+			return 1;
+		}
+	}
+	else if (!doSpeak && !out.close())
+	{
+		std::cerr << "Could not write output file." << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+
+
+/// generate with the random number generator and streams of settings, then report the memory used
+template <typename Model>
+int generate(const Model& model, const unsigned int Nmax, const uint64_t outputSize, eSpeak* speaker, TextWriter& out, const char* revCodeLUT, const GenerateSettings& settings)
+{
+	std::cout << "Random seed " << settings.seed << (settings.stdRandom ? " (std engine)" : " (xoshiro256**)") << std::endl;
+	int result;
+	if (settings.streams > 1 && settings.stdRandom)
+		result = generateStreams<StdRandom<std::default_random_engine> >(model, Nmax, outputSize, settings, revCodeLUT);
+	else if (settings.streams > 1)
+		result = generateStreams<Xoshiro256>(model, Nmax, outputSize, settings, revCodeLUT);
+	else if (settings.stdRandom)
+		result = generateText<StdRandom<std::default_random_engine> >(model, Nmax, outputSize, speaker, out, revCodeLUT, settings);
+	else
+		result = generateText<Xoshiro256>(model, Nmax, outputSize, speaker, out, revCodeLUT, settings);
+	if (result == 0)
+		reportMemory();
+	return result;
+}
+
+
 
 int main(int argc, char**argv)
 {
-	eSpeak speaker;
+	const auto         started = std::chrono::steady_clock::now();
 	const unsigned int Nmaxmax = 10;
 	unsigned int Nmax;
 	uint64_t     outputSize;
@@ -57,6 +664,100 @@ int main(int argc, char**argv)
 	std::istringstream issofs(argv[4]);
 	issofs >> outputSize;
 
+	bool useAlias = false;
+	bool useTrie  = false;
+	bool useAutomaton = false;
+	bool renderWav = false;
+	GenerateSettings settings = {uint64_t(std::chrono::system_clock::now().time_since_epoch().count()), false, 1, 0, false, argv[2], false, started};
+	std::vector<bool> useOrder(Nmax+1, true);
+	bool selectOrders = false;
+	unsigned int lazyFrom = Nmax+1;  // first order read on demand
+	for (int argIdx = 5; argIdx < argc; ++argIdx)
+	{
+		if (strcmp(argv[argIdx], "-a") == 0)
+			useAlias = true;
+		else if (strcmp(argv[argIdx], "-c") == 0)
+			useTrie = true;
+		else if (strcmp(argv[argIdx], "-x") == 0)
+			useTrie = useAutomaton = true;
+		else if (strcmp(argv[argIdx], "-s") == 0 && argIdx+1 < argc)
+		{
+			std::istringstream isss(argv[++argIdx]);
+			isss >> settings.streams;
+		}
+		else if (strcmp(argv[argIdx], "-t") == 0 && argIdx+1 < argc)
+		{
+			std::istringstream isst(argv[++argIdx]);
+			isst >> settings.threadCount;
+		}
+		else if (strcmp(argv[argIdx], "-i") == 0)
+			settings.interleave = true;
+		else if (strcmp(argv[argIdx], "-m") == 0)
+			settings.mapOutput = true;
+		else if (strcmp(argv[argIdx], "-w") == 0)
+			renderWav = true;
+		else if (strcmp(argv[argIdx], "-o") == 0 && argIdx+1 < argc)
+		{
+			std::istringstream isso(argv[++argIdx]);
+			useOrder.assign(Nmax+1, false);
+			selectOrders = true;
+			unsigned int order;
+			for (char sep = ','; sep == ',' && isso >> order; sep = isso.get())
+			{
+				if (order < 1 || order > Nmax)
+				{
+					helptext(argv[0], Nmaxmax);
+					return 1;
+				}
+				useOrder[order] = true;
+			}
+		}
+		else if (strcmp(argv[argIdx], "-l") == 0 && argIdx+1 < argc)
+		{
+			std::istringstream issl(argv[++argIdx]);
+			unsigned int low = Nmax;
+			if (!(issl >> low) || low > Nmax)
+			{
+				helptext(argv[0], Nmaxmax);
+				return 1;
+			}
+			lazyFrom = low+1;
+		}
+		else if (strcmp(argv[argIdx], "-r") == 0 && argIdx+1 < argc)
+		{
+			std::istringstream issr(argv[++argIdx]);
+			issr >> settings.seed;
+		}
+		else if (strcmp(argv[argIdx], "-g") == 0 && argIdx+1 < argc && strcmp(argv[argIdx+1], "std") == 0)
+		{
+			settings.stdRandom = true;
+			++argIdx;
+		}
+		else if (strcmp(argv[argIdx], "-g") == 0 && argIdx+1 < argc && strcmp(argv[argIdx+1], "xoshiro") == 0)
+		{
+			settings.stdRandom = false;
+			++argIdx;
+		}
+		else
+		{
+			helptext(argv[0], Nmaxmax);
+			return 1;
+		}
+	}
+	if (settings.threadCount == 0)
+		settings.threadCount = settings.streams;
+	if (settings.streams < 1)
+	{
+		helptext(argv[0], Nmaxmax);
+		return 1;
+	}
+	const bool lazy = lazyFrom <= Nmax;
+	if (lazy && (useAlias || useTrie))
+	{
+		std::cerr << "Orders read on demand cannot be sampled through alias tables or built into a trie." << std::endl;
+		return 1;
+	}
+
 	std::ifstream is(argv[1], std::ios::binary);
 	if (!is)
 	{
@@ -64,132 +765,150 @@ int main(int argc, char**argv)
 		return 1;
 	}
 
-	const bool doSpeak = strcmp(argv[2], "speak") == 0;
-	std::ofstream os;
-	if (!doSpeak)
+	const bool doSpeak = renderWav || strcmp(argv[2], "speak") == 0;
+	if (doSpeak && settings.streams > 1)
 	{
-		os.open(argv[2], std::ios::binary);
-		if (!os)
+		std::cerr << "Only one stream can be spoken." << std::endl;
+		return 1;
+	}
+
+	// text on stdout, keep the messages apart
+	const bool toStdout = strcmp(argv[2], "-") == 0;
+	if (toStdout && (settings.streams > 1 || settings.mapOutput || renderWav))
+	{
+		std::cerr << "Several streams, mapped output or speech rendering need an output file." << std::endl;
+		return 1;
+	}
+	if (toStdout)
+		std::cout.rdbuf(std::cerr.rdbuf());
+
+	// rendering synthesizes without an audio device, as fast as it goes
+	eSpeak speaker(renderWav ? AUDIO_OUTPUT_SYNCHRONOUS : AUDIO_OUTPUT_PLAYBACK);
+	WavWriter wav;
+	if (renderWav)
+	{
+		if (speaker.sampleRate() <= 0 || !wav.open(argv[2], speaker.sampleRate()))
+		{
+			std::cerr << "Could not open WAV file: " << argv[2] << std::endl;
+			return 1;
+		}
+		speaker.renderTo(&wav);
+	}
+
+	TextWriter out;
+	if (!doSpeak && settings.streams == 1)
+	{
+		if (!out.open(argv[2], settings.mapOutput ? outputSize : 0))
 		{
 			std::cerr << "Could not open output file: " << argv[2] << std::endl;
 			return 1;
 		}
 	}
 	else
-		std::cout << "Speaking:" << std::endl;
+		std::cout << (renderWav ? "Rendering speech:" : "Speaking:") << std::endl;
 
 	unsigned char codeLUT[256];
 	char revCodeLUT[Symbols];
 	fillLUT(codeLUT, revCodeLUT);
 
-	Ngram<1, Symbols, SymbolBits> ngram1;
-	Ngram<2, Symbols, SymbolBits> ngram2;
-	Ngram<3, Symbols, SymbolBits> ngram3;
-	Ngram<4, Symbols, SymbolBits> ngram4;
-	Ngram<5, Symbols, SymbolBits> ngram5;
-	Ngram<6, Symbols, SymbolBits> ngram6;
-	Ngram<7, Symbols, SymbolBits> ngram7;
-	Ngram<8, Symbols, SymbolBits> ngram8;
-	Ngram<9, Symbols, SymbolBits> ngram9;
-	Ngram<10, Symbols, SymbolBits> ngram10;
-
-	loadNgrams<1>(ngram1, is, Nmax);
-	loadNgrams<2>(ngram2, is, Nmax);
-	loadNgrams<3>(ngram3, is, Nmax);
-	loadNgrams<4>(ngram4, is, Nmax);
-	loadNgrams<5>(ngram5, is, Nmax);
-	loadNgrams<6>(ngram6, is, Nmax);
-	loadNgrams<7>(ngram7, is, Nmax);
-	loadNgrams<8>(ngram8, is, Nmax);
-	loadNgrams<9>(ngram9, is, Nmax);
-	loadNgrams<10>(ngram10, is, Nmax);
-
-	std::cout << "Generating " << outputSize << " character text:" << std::endl;
-
-	// random numbers:
-	std::default_random_engine generator(std::chrono::system_clock::now().time_since_epoch().count());
-	std::uniform_real_distribution<double> rnd01(0.0,1.0);
-
-	const unsigned int speakBufferSize = 10000;  // should be long enough?
-	unsigned char* speakBuffer = 0;
-	unsigned int speakIdx = 0;
-	if (doSpeak)
+	// mappedFormat files are used in place, others are loaded
+	// indexed files are checked first and their orders loaded in parallel
+	// (high orders of a lazily loaded one are decoded piecewise as used)
+	// the tables are dropped again once a trie is built from them
+	ContextTrie<Symbols, SymbolBits> trie;
+	ModelIndex index;
+	const bool indexed = index.read(is);
+	if ((selectOrders || lazy) && !indexed)
 	{
-		speakBuffer = new unsigned char[speakBufferSize];
-		speaker.speak("Hello!");
+		std::cerr << "Selecting orders or reading them on demand needs an indexed model file." << std::endl;
+		return 1;
 	}
-
-	unsigned char data[Nmax];
-	unsigned char* dataEnd = data+Nmax;
-	data[Nmax-1] = 0;		// start from a space (not written)
-	unsigned int usedN = 1; // generated from history length
-
-	for (uint64_t chout = 0; doSpeak || chout < outputSize; ++chout)
+	uint16_t header[3] = {0, 0, 0};
+	is.read((char*)header, 3*2);
+	is.seekg(indexed ? index.bytes() : 0);
+	const bool mappedInput = indexed ? index.orders() > 0 && index.section(1).format == mappedFormat : (header[2] >> 8) == mappedFormat;
+	if (mappedInput)
 	{
-		unsigned char gen = 255;
-		while (gen == 255)
+		MappedFile mapped(argv[1]);
+		const unsigned char* data = mapped.data();
+		NgramModel<NgramView, Nmaxmax> model;
+		if (!mapped.good() || !(indexed ? loadIndexed(model, mapped, index, Nmax, useOrder, lazyFrom, true) : model.view(data, data+mapped.size(), Nmax)))
 		{
-			double randnum = rnd01(generator);
-			switch (usedN)
-			{
-			case 0:
-				if (data[Nmax-1] != 0)
-				{
-					std::cout << "Error while generating, restarting from space" << std::endl;
-					gen = 0;
-				}
-				else
-				{
-					std::cout << "No character to start with!" << std::endl;
-					return 1;
-				}
-				break;
-			case 1: gen = ngram1.getChar(dataEnd-usedN, randnum); break;
-			case 2: gen = ngram2.getChar(dataEnd-usedN, randnum); break;
-			case 3: gen = ngram3.getChar(dataEnd-usedN, randnum); break;
-			case 4: gen = ngram4.getChar(dataEnd-usedN, randnum); break;
-			case 5: gen = ngram5.getChar(dataEnd-usedN, randnum); break;
-			case 6: gen = ngram6.getChar(dataEnd-usedN, randnum); break;
-			case 7: gen = ngram7.getChar(dataEnd-usedN, randnum); break;
-			case 8: gen = ngram8.getChar(dataEnd-usedN, randnum); break;
-			case 9: gen = ngram9.getChar(dataEnd-usedN, randnum); break;
-			case 10: gen = ngram10.getChar(dataEnd-usedN, randnum); break;
-			default: std::cout << "Unexpected N" << std::endl; return 1; break;
-			}
-			if (gen == 255) --usedN;
-		}
-		// ok character, can expect longer sequence next round
-		++usedN;
-		if (usedN > Nmax) usedN = Nmax;
-		// shift
-		for (unsigned int ii = 1; ii < Nmax; ++ii)
-			data[ii-1] = data[ii];
-		data[Nmax-1] = gen;
-		if (doSpeak)
+			std::cerr << "Could not map input file: " << argv[1] << std::endl;
+			return 1;
+		}
+		if (!useTrie)
 		{
-			speakBuffer[speakIdx] = revCodeLUT[gen];
-			std::cout << speakBuffer[speakIdx];
-			if (speakBuffer[speakIdx] == '.' || speakIdx == speakBufferSize-2)
+			if (useAlias)
+				model.freeze();
+			return generate(model, Nmax, outputSize, doSpeak ? &speaker : 0, out, revCodeLUT, settings);
+		}
+		if (!buildTrie(trie, model, Nmax))
+			return 1;
+	}
+	else if (lazy)
+	{
+		MappedFile mapped(argv[1]);
+		NgramModel<LazyNgram, Nmaxmax> model;
+		if (!loadIndexed(model, mapped, index, Nmax, useOrder, lazyFrom, false))
+			return 1;
+		const int result = generate(model, Nmax, outputSize, doSpeak ? &speaker : 0, out, revCodeLUT, settings);
+		for (unsigned int order = lazyFrom; order <= Nmax; ++order)
+		{
+			uint64_t pagedIn, pieces;
+			if (!useOrder[order])
+				continue;
+			if (!model.paging(order, pagedIn, pieces))
 			{
-				std::cout << std::endl;
-				speakBuffer[speakIdx +1] = 0;
-				speaker.speak((char*)speakBuffer);
-				speakIdx = 0;
+				std::cerr << "Model file is corrupt (" << order << "-gram table), generated with parts of it missing." << std::endl;
+				return 1;
 			}
-			else
-				++speakIdx;
+			std::cout << order << "-grams: " << pagedIn << " of " << pieces << (pieces > 1 ? " blocks" : " table") << " read." << std::endl;
+		}
+		return result;
+	}
+	else
+	{
+		NgramModel<Ngram, Nmaxmax> model;
+		if (indexed)
+		{
+			MappedFile mapped(argv[1]);
+			if (!loadIndexed(model, mapped, index, Nmax, useOrder, Nmax+1, false))
+				return 1;
 		}
 		else
+			model.load(is, Nmax, std::max(1u, std::thread::hardware_concurrency()));
+		if (!useTrie)
 		{
-			os.write(revCodeLUT+gen, 1);
+			if (useAlias)
+				model.freeze();
+			return generate(model, Nmax, outputSize, doSpeak ? &speaker : 0, out, revCodeLUT, settings);
 		}
+		if (!buildTrie(trie, model, Nmax))
+			return 1;
 	}
 
+	if (useAutomaton)
+	{
+		std::cout << "Compiling transition automaton..." << std::flush;
+		TransitionAutomaton<Symbols, SymbolBits> automaton;
+		if (!automaton.compile(trie))
+		{
+			std::cerr << std::endl << "Model too large for a transition automaton (more than 2^26 buckets), use -c instead." << std::endl;
+			return 1;
+		}
+		std::cout << " " << automaton.size() << " states, " << automaton.bytes()/1024 << " kB." << std::endl;
+		trie = ContextTrie<Symbols, SymbolBits>();
+		return generate(automaton, Nmax, outputSize, doSpeak ? &speaker : 0, out, revCodeLUT, settings);
+	}
 
-	return 0;
+	if (useAlias)
+		trie.freeze();
+	return generate(trie, Nmax, outputSize, doSpeak ? &speaker : 0, out, revCodeLUT, settings);
 }
 
 
+
 /*
 int mainOld()
 {
@@ -2,7 +2,11 @@
 #define SPEAK_H_
 
 #include "speak_lib.h"
+#include "wavwriter.h"
+#include <atomic>
+#include <chrono>
 #include <cstring>
+#include <unistd.h>
 
 // dependencies: libespeak-dev (-lespeak)
 // http://espeak.sourceforge.net/speak_lib.h
@@ -10,12 +14,29 @@
 class eSpeak
 {
 public:
-	eSpeak()
+	/// output AUDIO_OUTPUT_PLAYBACK plays on the sound device, AUDIO_OUTPUT_SYNCHRONOUS renders (see renderTo)
+	eSpeak(espeak_AUDIO_OUTPUT output = AUDIO_OUTPUT_PLAYBACK)
+	: wav(0), audioStarted(false)
 	{
-		espeak_Initialize(AUDIO_OUTPUT_PLAYBACK, 0, NULL,0);
+		plainTag.owner = timedTag.owner = this;
+		plainTag.timed = false;
+		timedTag.timed = true;
+		rate = espeak_Initialize(output, 0, NULL,0);
+		espeak_SetSynthCallback(synthCallback);
 	}
 
 
+	/// synthesize into wav instead of playing (needs AUDIO_OUTPUT_SYNCHRONOUS), no audio device used
+	void renderTo(WavWriter* wav)
+	{
+		this->wav = wav;
+	}
+
+
+	WavWriter* renderTarget() const { return wav; }
+	int        sampleRate() const { return rate; }
+
+
 	void lang(const char *lang)
 	{
 		espeak_SetVoiceByName(lang);
@@ -24,7 +45,38 @@ public:
 
 	void speak(char *word)
 	{
-		espeak_Synth((char*)word, strlen(word)+1, 0, POS_CHARACTER, 0, espeakCHARS_AUTO, NULL, NULL);
+		submit(word);
+		synchronize();
+	}
+
+
+	/**
+	 * Queue text behind what espeak is still speaking (espeak copies it),
+	 * waiting while its buffer is full. With timed, the time its audio
+	 * starts is recorded (see firstAudio) unless one was recorded before.
+	 */
+	bool submit(const char *word, bool timed = false)
+	{
+		espeak_ERROR result;
+		while ((result = espeak_Synth(word, strlen(word)+1, 0, POS_CHARACTER, 0, espeakCHARS_AUTO, NULL, timed ? &timedTag : &plainTag)) == EE_BUFFER_FULL)
+			usleep(10000);
+		return result == EE_OK;
+	}
+
+
+	/// when the audio of timed text started (rendered or played), false if it has not yet
+	bool firstAudio(std::chrono::steady_clock::time_point& at) const
+	{
+		if (!audioStarted.load(std::memory_order_acquire))
+			return false;
+		at = audioStart;
+		return true;
+	}
+
+
+	/// wait until all submitted text is spoken
+	void synchronize()
+	{
 		espeak_Synchronize();
 	}
 
@@ -48,6 +100,39 @@ public:
 	{
 		espeak_Terminate();
 	}
+
+private:
+	// user data given to espeak_Synth
+	struct Tag
+	{
+		eSpeak* owner;
+		bool    timed;
+	};
+
+	WavWriter*        wav;
+	int               rate;
+	Tag               plainTag;
+	Tag               timedTag;
+	std::atomic<bool> audioStarted;
+	std::chrono::steady_clock::time_point audioStart;
+
+	// samples of one synthesis chunk when rendering, events as they are played otherwise
+	static int synthCallback(short* samples, int length, espeak_EVENT* events)
+	{
+		const Tag* tag = static_cast<const Tag*>(events->user_data);
+		if (!tag)
+			return 0;
+		eSpeak& owner = *tag->owner;
+		const bool audio = (samples && length > 0) || events->type == espeakEVENT_WORD || events->type == espeakEVENT_SENTENCE;
+		if (tag->timed && audio && !owner.audioStarted.load(std::memory_order_relaxed))
+		{
+			owner.audioStart = std::chrono::steady_clock::now();
+			owner.audioStarted.store(true, std::memory_order_release);
+		}
+		if (samples && length > 0 && owner.wav)
+			owner.wav->write(samples, length);
+		return 0;
+	}
 };
 
 
@@ -0,0 +1,123 @@
+/*
+ * Speaking generated sentences on a separate thread.
+ */
+
+#ifndef SPEECHPIPELINE_H
+#define SPEECHPIPELINE_H
+
+#include "speak.h"
+#include "spscqueue.h"
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+/***
+ * The generating thread queues finished sentences while a speech thread
+ * submits them to espeak, which queues them behind the one being spoken,
+ * so generation never waits for audio and playback runs without gaps.
+ * Each sentence is printed with the queue depth as it is submitted, the
+ * time from construction until the audio of the first queued sentence
+ * starts (see eSpeak::firstAudio) is reported once. The speech thread
+ * sleeps while the queue is empty.
+ */
+class SpeechPipeline
+{
+public:
+	/// greeting is spoken first if not empty, echo prints the sentences as they are spoken
+	SpeechPipeline(eSpeak& speaker, const char* greeting, bool echo = true)
+	: speaker(speaker), greeting(greeting), echo(echo), finished(false), startTime(std::chrono::steady_clock::now())
+	{
+		thread = std::thread(&SpeechPipeline::run, this);
+	};
+
+	/// speak what is queued and wait for it to be spoken, then stop the speech thread
+	~SpeechPipeline()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			finished = true;
+		}
+		wakeup.notify_one();
+		thread.join();
+	};
+
+	/// queue a sentence (moved from), waiting while the queue is full
+	void push(std::string& sentence)
+	{
+		while (!queue.push(sentence))
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		// the speech thread checks the queue under the lock, so it is either waiting or sees the sentence
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+		}
+		wakeup.notify_one();
+	};
+
+private:
+	SpeechPipeline(const SpeechPipeline&);
+	SpeechPipeline& operator=(const SpeechPipeline&);
+
+	typedef SpscQueue<std::string, 16> QueueType;
+
+	eSpeak&           speaker;
+	std::string       greeting;
+	bool              echo;
+	QueueType         queue;
+	std::mutex        mutex;   // for waiting on wakeup
+	std::condition_variable wakeup;  // a sentence was queued or finished set
+	std::atomic<bool> finished;
+	std::chrono::steady_clock::time_point startTime;
+	std::thread       thread;
+
+	void run()
+	{
+		if (!greeting.empty())
+			speaker.submit(greeting.c_str());
+
+		bool first = true;
+		bool reported = false;
+		std::string sentence;
+		for (;;)
+		{
+			// finished is read first, a sentence pushed before it was set is popped below
+			const bool   done  = finished;
+			const size_t depth = queue.size();
+			if (!queue.pop(sentence))
+			{
+				if (done)
+					break;
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeup.wait(lock, [this]() { return queue.size() > 0 || finished; });
+				continue;
+			}
+
+			if (echo)
+				std::cout << sentence << "  [queue " << depth << "/" << QueueType::capacity() << "]" << std::endl;
+			speaker.submit(sentence.c_str(), first);
+			first = false;
+			reported = reported || report();
+		}
+		speaker.synchronize();
+		if (!reported)
+			report();
+	};
+
+	/// print the time to first audio if it has started, false if not
+	bool report()
+	{
+		std::chrono::steady_clock::time_point at;
+		if (!speaker.firstAudio(at))
+			return false;
+		const double ms = std::chrono::duration<double, std::milli>(at - startTime).count();
+		std::cout << "Time to first audio: " << ms << " ms" << std::endl;
+		return true;
+	};
+};
+
+
+
+#endif
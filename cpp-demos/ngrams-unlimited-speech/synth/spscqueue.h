@@ -0,0 +1,61 @@
+/*
+ * Bounded lock free queue for one producer and one consumer thread.
+ */
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+#include <cstddef>
+
+/***
+ * Ring buffer of Capacity items (a power of two). The producer only
+ * writes tail and the consumer only head, each publishing its side with
+ * release stores, so neither ever waits for the other.
+ */
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+public:
+	static_assert(Capacity > 0 && (Capacity & (Capacity-1)) == 0, "capacity is a power of two");
+
+	SpscQueue() : head(0), tail(0) { };
+
+	/// producer: move item into the queue, return false if full
+	bool push(T& item)
+	{
+		const size_t pos = tail.load(std::memory_order_relaxed);
+		if (pos - head.load(std::memory_order_acquire) == Capacity)
+			return false;
+		items[pos & (Capacity-1)] = std::move(item);
+		tail.store(pos+1, std::memory_order_release);
+		return true;
+	};
+
+	/// consumer: move the oldest item out, return false if empty
+	bool pop(T& item)
+	{
+		const size_t pos = head.load(std::memory_order_relaxed);
+		if (pos == tail.load(std::memory_order_acquire))
+			return false;
+		item = std::move(items[pos & (Capacity-1)]);
+		head.store(pos+1, std::memory_order_release);
+		return true;
+	};
+
+	size_t size() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); };
+	static size_t capacity() { return Capacity; };
+
+private:
+	// head and tail on separate cache lines (padding since aligned new is C++17)
+	T                   items[Capacity];
+	char                pad0[64];
+	std::atomic<size_t> head;  // next item to pop
+	char                pad1[64 - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> tail;  // next slot to push to
+};
+
+
+
+#endif
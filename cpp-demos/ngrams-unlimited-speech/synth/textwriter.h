@@ -0,0 +1,175 @@
+/*
+ * Buffered output of generated text.
+ */
+
+#ifndef TEXTWRITER_H
+#define TEXTWRITER_H
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/***
+ * Collects characters in a large buffer written with one system call per
+ * block, or directly in a shared mapping of the output file pre-sized to
+ * the expected length.
+ */
+class TextWriter
+{
+public:
+	TextWriter() : fd(-1), mapped(0), mapLen(0), pos(0), end(0), failed(false) { };
+	~TextWriter() { close(); };
+
+	/**
+	 * Open path for writing, "-" is stdout. mapSize > 0 pre-sizes the file
+	 * to mapSize bytes and writes through a mapping (cut to the written
+	 * length on close). Returns false on failure.
+	 */
+	bool open(const char* path, uint64_t mapSize = 0);
+
+	inline void put(char ch)
+	{
+		if (pos == end)
+			flush();
+		*pos++ = ch;
+	};
+
+	void flush();  ///< write out buffered characters (growing a mapping if full)
+	bool close();  ///< flush and close, return false if anything failed to be written
+
+private:
+	TextWriter(const TextWriter&);
+	TextWriter& operator=(const TextWriter&);
+
+	static const size_t bufferSize = 1 << 20;
+
+	int               fd;
+	char*             mapped;
+	uint64_t          mapLen;
+	std::vector<char> buffer;
+	char*             pos;
+	char*             end;
+	bool              failed;
+
+	bool map(uint64_t length);
+};
+
+
+
+
+inline bool TextWriter::
+open(const char* path, uint64_t mapSize)
+{
+	close();
+	failed = false;
+	if (strcmp(path, "-") == 0)
+		fd = dup(STDOUT_FILENO);
+	else
+		fd = ::open(path, (mapSize > 0 ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+
+	if (mapSize > 0 && map(mapSize))
+		return true;
+
+	buffer.resize(bufferSize);
+	pos = &buffer[0];
+	end = pos + buffer.size();
+	return true;
+}
+
+
+
+inline void TextWriter::
+flush()
+{
+	if (mapped)
+	{
+		// full mapping: grow it, or continue with plain writes after it
+		if (pos < end || map(2*mapLen))
+			return;
+
+		munmap(mapped, mapLen);
+		if (lseek(fd, mapLen, SEEK_SET) < 0)
+			failed = true;
+		mapped = 0;
+		mapLen = 0;
+		buffer.resize(bufferSize);
+		pos = &buffer[0];
+		end = pos + buffer.size();
+		return;
+	}
+	if (fd < 0 || buffer.empty())
+		return;
+
+	for (const char* data = &buffer[0]; data < pos; )
+	{
+		const ssize_t written = write(fd, data, pos - data);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+		{
+			failed = true;
+			break;
+		}
+		data += written;
+	}
+	pos = &buffer[0];
+}
+
+
+
+inline bool TextWriter::
+close()
+{
+	if (fd < 0)
+		return !failed;
+
+	if (mapped)
+	{
+		const uint64_t length = pos - mapped;
+		munmap(mapped, mapLen);
+		if (ftruncate(fd, length) != 0)
+			failed = true;
+		mapped = 0;
+		mapLen = 0;
+	}
+	else
+		flush();
+
+	::close(fd);
+	fd = -1;
+	buffer.clear();
+	pos = end = 0;
+	return !failed;
+}
+
+
+
+inline bool TextWriter::
+map(uint64_t length)
+{
+	const uint64_t used = mapped ? pos - mapped : 0;
+	if (ftruncate(fd, length) != 0)
+		return false;
+
+	void* addr = mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		return false;
+
+	if (mapped)
+		munmap(mapped, mapLen);
+	mapped = static_cast<char*>(addr);
+	mapLen = length;
+	pos = mapped + used;
+	end = mapped + mapLen;
+	return true;
+}
+
+
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Writing 16 bit mono PCM samples to a WAV file.
+ */
+
+#ifndef WAVWRITER_H
+#define WAVWRITER_H
+
+#include <fstream>
+#include <cstdint>
+
+/***
+ * Streams samples to a canonical 44 byte header WAV file, the chunk sizes
+ * in the header are filled in on close. Samples are written as they are
+ * in memory (little endian hosts).
+ */
+class WavWriter
+{
+public:
+	WavWriter() : rate(0), count(0) { };
+	~WavWriter() { close(); };
+
+	bool open(const char* path, unsigned int sampleRate)
+	{
+		close();
+		os.open(path, std::ios::binary | std::ios::trunc);
+		rate  = sampleRate;
+		count = 0;
+		writeHeader();
+		return os.good();
+	};
+
+	void write(const short* samples, int length)
+	{
+		os.write((const char*)samples, length*sizeof(short));
+		count += length;
+	};
+
+	/// fill in the header and close, return false if anything failed to be written
+	bool close()
+	{
+		if (!os.is_open())
+			return true;
+		os.seekp(0);
+		writeHeader();
+		const bool good = os.good();
+		os.close();
+		return good;
+	};
+
+	uint64_t     samples() const { return count; };
+	unsigned int sampleRate() const { return rate; };
+
+private:
+	std::ofstream os;
+	unsigned int  rate;
+	uint64_t      count;
+
+	void put(uint32_t value, unsigned int bytes)
+	{
+		for (unsigned int ii = 0; ii < bytes; ++ii)
+			os.put(char(value >> (8*ii)));
+	};
+
+	void writeHeader()
+	{
+		const uint32_t dataBytes = count*sizeof(short);
+		os.write("RIFF", 4);
+		put(36 + dataBytes, 4);
+		os.write("WAVEfmt ", 8);
+		put(16, 4);            // fmt chunk size
+		put(1, 2);             // PCM
+		put(1, 2);             // mono
+		put(rate, 4);
+		put(rate*2, 4);        // bytes per second
+		put(2, 2);             // bytes per sample frame
+		put(16, 2);            // bits per sample
+		os.write("data", 4);
+		put(dataBytes, 4);
+	};
+};
+
+
+
+#endif
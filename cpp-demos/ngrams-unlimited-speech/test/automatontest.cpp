@@ -0,0 +1,207 @@
+/*
+ * Checks TransitionAutomaton against the linear sampler of the Ngram tables
+ * it is compiled from (Ngram::getChar before freeze()).
+ *
+ * Build and run, e.g.
+ *   g++ -O2 -std=c++11 -o automatontest automatontest.cpp
+ * Exits with 1 on the first mismatch.
+ */
+
+#include "../transitionautomaton.h"
+#include "../ngram.h"
+#include <iostream>
+#include <vector>
+#include <map>
+#include <random>
+#include <numeric>
+#include <cmath>
+
+
+const size_t       Symbols    = 6;
+const size_t       SymbolBits = 3;
+const unsigned int Nmax       = 3;
+
+const uint64_t steps   = 4000000;
+const double   maxDiff = 6.0;  // standard deviations a draw frequency may be off
+
+
+
+/// orders 1 to Nmax as the generator loads them, the source of ContextTrie::build
+struct Model
+{
+	Ngram<1, Symbols, SymbolBits> order1;
+	Ngram<2, Symbols, SymbolBits> order2;
+	Ngram<3, Symbols, SymbolBits> order3;
+
+	void addSample(const ContextKey<SymbolBits>& history, unsigned char next)
+	{
+		order1.addSample(history, next);
+		order2.addSample(history, next);
+		order3.addSample(history, next);
+	};
+
+	/// linear draw from one order, 255 if it lacks the context
+	unsigned char getChar(unsigned int order, const ContextKey<SymbolBits>& history, uint64_t rand64) const
+	{
+		return order == 1 ? order1.getChar(history, rand64) : order == 2 ? order2.getChar(history, rand64) : order3.getChar(history, rand64);
+	};
+
+	bool lookup(unsigned int order, uint64_t key, uint32_t& mask, uint64_t* packed) const
+	{
+		return order == 1 ? order1.lookup(key, mask, packed) : order == 2 ? order2.lookup(key, mask, packed) : order3.lookup(key, mask, packed);
+	};
+
+	template <typename Visitor>
+	void visit(unsigned int order, Visitor visitor) const
+	{
+		if (order == 1)
+			order1.visit(visitor);
+		else if (order == 2)
+			order2.visit(visitor);
+		else if (order == 3)
+			order3.visit(visitor);
+	};
+};
+
+
+
+/**
+ * Count text from a random second order source with sparse transitions,
+ * then drop rare contexts above order 1 as ngramana -p does, so that
+ * generation backs off.
+ */
+void train(std::mt19937_64& random, Model& model)
+{
+	std::vector<double> weights(Symbols*Symbols*Symbols);
+	std::uniform_real_distribution<double> uniform(0, 1);
+	for (size_t ii = 0; ii < weights.size(); ++ii)
+		weights[ii] = uniform(random) < 0.3 ? 0.0 : uniform(random);
+
+	ContextKey<SymbolBits> history;
+	history.push(0);
+	for (unsigned int ii = 0; ii < 3000; ++ii)
+	{
+		const std::vector<double>::const_iterator first = weights.begin() + (history.symbol(1)*Symbols + history.symbol(0))*Symbols;
+		std::discrete_distribution<int> next(first, first + Symbols);
+		const unsigned char sym = std::accumulate(first, first + Symbols, 0.0) > 0 ? next(random) : random() % Symbols;
+		model.addSample(history, sym);
+		history.push(sym);
+	}
+
+	model.order2.prune([](uint64_t, uint32_t, const uint64_t* packed) { return packed[0] >= 60; });
+	model.order3.prune([](uint64_t, uint32_t, const uint64_t* packed) { return packed[0] >= 24; });
+}
+
+
+
+/// draws of each symbol in one context by the automaton and by the linear sampler
+struct Tally
+{
+	uint64_t automaton[Symbols];
+	uint64_t linear[Symbols];
+};
+
+/**
+ * Generate with the automaton while following the same history through the
+ * tables as the generator does (longest order having the context, at most
+ * one order more than the last draw). Each automaton draw must come from
+ * the successors of that context; the linear sampler draws once from it as
+ * well. Then the draw frequencies of both are compared to the counts.
+ */
+bool test(std::mt19937_64& random, const Model& model, const TransitionAutomaton<Symbols, SymbolBits>& automaton)
+{
+	typedef std::pair<unsigned int, uint64_t> ContextType; // order, key
+	std::map<ContextType, Tally> tallies;
+
+	TransitionAutomaton<Symbols, SymbolBits>::State state = automaton.start(Nmax);
+	ContextKey<SymbolBits> history;
+	history.push(0);
+	unsigned int order = 1;
+	uint32_t mask;
+	uint64_t packed[Symbols+1];
+	for (uint64_t step = 0; step < steps; ++step)
+	{
+		while (order > 0 && !model.lookup(order, history.get(order), mask, packed))
+			--order;
+
+		const unsigned char sym = automaton.getChar(state, random());
+		if (order == 0 || sym == 255)
+		{
+			if (order != 0 || sym != 255)
+			{
+				std::cerr << "step " << step << ": automaton drew " << int(sym) << " with no context of order " << order << std::endl;
+				return false;
+			}
+			automaton.push(state, 0);
+			history.push(0);
+			order = 1;
+			continue;
+		}
+		if (sym >= Symbols || !(mask >> sym & 1))
+		{
+			std::cerr << "step " << step << ": automaton drew " << int(sym) << ", not a successor of the order " << order << " context" << std::endl;
+			return false;
+		}
+
+		const std::map<ContextType, Tally>::iterator found = tallies.insert(std::make_pair(ContextType(order, history.get(order)), Tally())).first;
+		++found->second.automaton[sym];
+		++found->second.linear[model.getChar(order, history, random())];
+
+		automaton.push(state, sym);
+		history.push(sym);
+		order = std::min(order+1, Nmax);
+	}
+
+	for (std::map<ContextType, Tally>::const_iterator it = tallies.begin(); it != tallies.end(); ++it)
+	{
+		model.lookup(it->first.first, it->first.second, mask, packed);
+		uint64_t draws = 0;
+		for (size_t sym = 0; sym < Symbols; ++sym)
+			draws += it->second.automaton[sym];
+
+		size_t idx = 1;
+		for (size_t sym = 0; sym < Symbols; ++sym)
+		{
+			const double p = mask >> sym & 1 ? double(packed[idx++]) / packed[0] : 0.0;
+			const double sd = std::sqrt(draws * p * (1-p)) + 1e-9;
+			const double automatonDiff = std::fabs(it->second.automaton[sym] - draws*p) / sd;
+			const double linearDiff    = std::fabs(it->second.linear[sym] - draws*p) / sd;
+			if (automatonDiff > maxDiff || linearDiff > maxDiff)
+			{
+				std::cerr << "order " << it->first.first << " context " << it->first.second << ", symbol " << sym << ": drawn "
+				          << it->second.automaton[sym] << " times by the automaton, " << it->second.linear[sym] << " by the linear sampler, expected "
+				          << draws*p << " of " << draws << std::endl;
+				return false;
+			}
+		}
+	}
+
+	std::cout << steps << " draws in " << tallies.size() << " contexts match the linear sampler." << std::endl;
+	return true;
+}
+
+
+
+int main()
+{
+	std::mt19937_64 random(12345);
+	for (unsigned int round = 0; round < 4; ++round)
+	{
+		Model model;
+		train(random, model);
+
+		ContextTrie<Symbols, SymbolBits> trie;
+		TransitionAutomaton<Symbols, SymbolBits> automaton;
+		if (!trie.build(model, Nmax) || !automaton.compile(trie))
+		{
+			std::cerr << "Could not compile the model." << std::endl;
+			return 1;
+		}
+		if (!test(random, model, automaton))
+		{
+			std::cerr << "failed in round " << round << std::endl;
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * Checks the vector versions of encodeBlock against encodeBlockScalar.
+ *
+ * Build with the vector versions enabled and run, e.g.
+ *   g++ -O2 -std=c++11 -mavx2 -o encodeblocktest encodeblocktest.cpp   (AVX2 and SSSE3)
+ *   g++ -O2 -std=c++11 -mssse3 -o encodeblocktest encodeblocktest.cpp  (SSSE3)
+ * Exits with 1 on the first mismatch.
+ */
+
+#include "../analyze/encodeblock.h"
+#include "../ngram.h"
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cstring>
+
+
+typedef size_t (*EncodeFunction)(const unsigned char*, size_t, unsigned char*, const unsigned char[256], unsigned char, bool&);
+
+const size_t guardBytes = 64;
+const unsigned char guardValue = 0xa5;
+
+
+
+/// table of random codes below symbols, a fraction of them whitespace (0) or dropped (>= symbols)
+void randomLUT(std::mt19937& random, unsigned char codeLUT[256], unsigned char symbols, double whitespace, double dropped)
+{
+	std::uniform_real_distribution<double> uniform(0, 1);
+	for (unsigned int ii = 0; ii < 256; ++ii)
+	{
+		const double draw = uniform(random);
+		if (draw < whitespace)
+			codeLUT[ii] = 0;
+		else if (draw < whitespace + dropped)
+			codeLUT[ii] = symbols + random() % (256 - symbols);
+		else
+			codeLUT[ii] = 1 + random() % (symbols - 1);
+	}
+}
+
+
+
+/**
+ * Text of length bytes from runs of bytes mapping to whitespace and to
+ * symbols, run lengths up to maxRun so runs cross the 16 and 32 byte
+ * vector boundaries in all positions.
+ */
+std::vector<unsigned char> randomText(std::mt19937& random, const unsigned char codeLUT[256], size_t length, size_t maxRun)
+{
+	std::vector<unsigned char> space;
+	std::vector<unsigned char> other;
+	for (unsigned int ii = 0; ii < 256; ++ii)
+		(codeLUT[ii] == 0 ? space : other).push_back(ii);
+
+	std::vector<unsigned char> text;
+	bool inSpace = random() % 2;
+	while (text.size() < length)
+	{
+		const std::vector<unsigned char>& pick = inSpace && !space.empty() ? space : other;
+		const size_t run = 1 + random() % maxRun;
+		for (size_t ii = 0; ii < run && text.size() < length; ++ii)
+			text.push_back(pick.empty() ? random() : pick[random() % pick.size()]);
+		inSpace = !inSpace;
+	}
+	return text;
+}
+
+
+
+/**
+ * Encode text in blocks of random lengths (odd ones included) with both
+ * functions, carrying WSlast between blocks, and compare the output and
+ * the state after each block. The output is checked for writes past the
+ * input length.
+ */
+bool compare(std::mt19937& random, EncodeFunction encode, const std::vector<unsigned char>& text, const unsigned char codeLUT[256], unsigned char symbols, size_t maxBlock)
+{
+	bool wsExpected = random() % 2;
+	bool wsTested   = wsExpected;
+	std::vector<unsigned char> expected(maxBlock);
+	std::vector<unsigned char> tested(maxBlock + guardBytes);
+	for (size_t pos = 0; pos < text.size(); )
+	{
+		const size_t length = std::min<size_t>(random() % (maxBlock+1), text.size() - pos);
+		std::memset(tested.data(), guardValue, tested.size());
+		const size_t expectedLen = encodeBlockScalar(&text[pos], length, expected.data(), codeLUT, symbols, wsExpected);
+		const size_t testedLen   = encode(&text[pos], length, tested.data(), codeLUT, symbols, wsTested);
+
+		if (testedLen != expectedLen || std::memcmp(tested.data(), expected.data(), expectedLen) != 0 || wsTested != wsExpected)
+		{
+			std::cerr << "mismatch in block at " << pos << " of length " << length << ": " << testedLen << " symbols, expected " << expectedLen << std::endl;
+			return false;
+		}
+		for (size_t ii = length; ii < tested.size(); ++ii)
+		{
+			if (tested[ii] != guardValue)
+			{
+				std::cerr << "write past the input length in block at " << pos << " of length " << length << std::endl;
+				return false;
+			}
+		}
+		pos += length;
+	}
+	return true;
+}
+
+
+
+/// random tables and texts, then the real table on text of all bytes
+bool test(const char* name, EncodeFunction encode)
+{
+	std::mt19937 random(12345);
+	size_t cases = 0;
+	for (unsigned int round = 0; round < 2000; ++round)
+	{
+		const unsigned char symbols = 2 + random() % 60;
+		const double whitespace = (random() % 5) * 0.15;
+		const double dropped    = (random() % 4 == 0) ? 0.0 : (random() % 3) * 0.05;
+		unsigned char codeLUT[256];
+		randomLUT(random, codeLUT, symbols, whitespace, dropped);
+
+		const size_t maxRun = 1 + random() % 70;
+		const std::vector<unsigned char> text = randomText(random, codeLUT, 1 + random() % 4000, maxRun);
+		const size_t maxBlock = round % 2 ? 1 + random() % 200 : 4096;
+		if (!compare(random, encode, text, codeLUT, symbols, maxBlock))
+		{
+			std::cerr << name << ": failed in round " << round << std::endl;
+			return false;
+		}
+		++cases;
+	}
+
+	unsigned char codeLUT[256];
+	char revCodeLUT[29];
+	fillLUT(codeLUT, revCodeLUT);
+	for (unsigned int round = 0; round < 200; ++round)
+	{
+		std::vector<unsigned char> text(1 + random() % 5000);
+		for (size_t ii = 0; ii < text.size(); ++ii)
+			text[ii] = random();
+		if (!compare(random, encode, text, codeLUT, 29, 1 + random() % 300))
+		{
+			std::cerr << name << ": failed on the analyzer table in round " << round << std::endl;
+			return false;
+		}
+		++cases;
+	}
+
+	std::cout << name << ": " << cases << " cases identical to encodeBlockScalar." << std::endl;
+	return true;
+}
+
+
+
+int main()
+{
+	unsigned int tested = 0;
+#if defined(__AVX2__)
+	if (!test("encodeBlockAVX2", encodeBlockAVX2))
+		return 1;
+	++tested;
+#endif
+#if defined(__SSSE3__)
+	if (!test("encodeBlockSSSE3", encodeBlockSSSE3))
+		return 1;
+	++tested;
+#endif
+	if (!test("encodeBlock", encodeBlock))
+		return 1;
+	if (tested == 0)
+		std::cout << "No vector version compiled in (build with -mssse3 or -mavx2)." << std::endl;
+	return 0;
+}
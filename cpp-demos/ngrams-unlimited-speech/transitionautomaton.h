@@ -0,0 +1,158 @@
+/*
+ * Generation model compiled into alias tables with precomputed transitions,
+ * drawing as the linear sampler of the tables does (see test/automatontest.cpp).
+ */
+
+#ifndef TRANSITIONAUTOMATON_H
+#define TRANSITIONAUTOMATON_H
+
+#include "contexttrie.h"
+#include "aliassampler.h"
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/***
+ * One state per context with successors, holding an alias table (see
+ * AliasSampler) of its successors. Each bucket also holds, for both of
+ * its symbols, the state generation continues in after drawing it: the
+ * longest context with successors ending in that symbol, as found by
+ * ContextTrie::push. A draw reads one bucket and moves on without any
+ * lookup or backoff.
+ *
+ * States are referred to by their table as in AliasSampler (first bucket
+ * << 6 | bucket count), the empty table 0 is the state without successors.
+ *
+ * SymCount: cardinality of symbol set (at most 32)
+ * SymBits:  bits needed to enumerate symbol set
+ */
+template <size_t SymCount, size_t SymBits>
+class TransitionAutomaton
+{
+public:
+	struct State
+	{
+		uint32_t      ref;   ///< current state
+		uint32_t      next;  ///< state following the last drawn symbol
+		unsigned char drawn; ///< last drawn symbol, 255 if none
+	};
+
+	TransitionAutomaton() : restart(SymCount, 0), stateCount(0) { };
+
+	/**
+	 * Compile the contexts of trie, return false if the model is too large
+	 * for 32 bit state references (2^26 buckets).
+	 */
+	bool compile(const ContextTrie<SymCount, SymBits>& trie);
+
+	State         start(unsigned int) const { State state = {0, 0, 255}; push(state, 0); return state; }; ///< history of one space
+	inline unsigned char getChar(State& state, uint64_t rand64) const; ///< return 255 if the state has no successors
+	/// continue after sym, symbols not just drawn restart from the longest context of sym alone
+	inline void   push(State& state, unsigned char sym) const;
+
+	uint64_t size() const { return stateCount; };
+	uint64_t bytes() const { return buckets.size()*sizeof(Bucket) + restart.size()*4; };
+
+private:
+	struct Bucket
+	{
+		uint32_t      threshold; ///< keep symbol with probability threshold / 2^32, else alias
+		unsigned char symbol;
+		unsigned char alias;
+		uint32_t      next[2];   ///< states after symbol and alias
+	};
+
+	std::vector<Bucket>   buckets;
+	std::vector<uint32_t> restart;  // state after each symbol from the empty context
+	uint64_t              stateCount;
+};
+
+
+
+
+template <size_t SymCount, size_t SymBits>
+bool TransitionAutomaton<SymCount, SymBits>::
+compile(const ContextTrie<SymCount, SymBits>& trie)
+{
+	typedef typename ContextTrie<SymCount, SymBits>::State NodeType;
+
+	AliasSampler          sampler;
+	std::vector<uint64_t> refs(trie.size(), 0);
+	stateCount = 0;
+	trie.visit([&](NodeType node, uint32_t mask, const uint64_t* packed)
+	{
+		refs[node] = sampler.add(mask, packed);
+		++stateCount;
+	});
+	if (sampler.size() >= (uint64_t(1) << 26))
+		return false;
+
+	buckets.resize(sampler.size());
+	trie.visit([&](NodeType node, uint32_t, const uint64_t*)
+	{
+		const uint64_t ref = refs[node];
+		for (uint64_t idx = ref >> 6; idx < (ref >> 6) + (ref & 63); ++idx)
+		{
+			const AliasSampler::Entry& src = sampler.entry(idx);
+			Bucket& dst = buckets[idx];
+			dst.threshold = src.threshold;
+			dst.symbol    = src.symbol;
+			dst.alias     = src.alias;
+
+			NodeType next = node;
+			trie.push(next, src.symbol);
+			dst.next[0] = refs[next];
+			next = node;
+			trie.push(next, src.alias);
+			dst.next[1] = refs[next];
+		}
+	});
+
+	for (size_t sym = 0; sym < SymCount; ++sym)
+	{
+		NodeType next = 0;
+		trie.push(next, sym);
+		restart[sym] = refs[next];
+	}
+
+	return true;
+}
+
+
+
+template <size_t SymCount, size_t SymBits>
+unsigned char TransitionAutomaton<SymCount, SymBits>::
+getChar(State& state, uint64_t rand64) const
+{
+	// as AliasSampler::sample
+	const size_t count = state.ref & 63;
+	if (count == 0)
+	{
+		state.drawn = 255;
+		return 255;
+	}
+
+	// bucket from the high, fraction from the low half of the product
+	const unsigned __int128 scaled = (unsigned __int128)rand64 * count;
+	const size_t   bucket = scaled >> 64;
+	const Bucket&  found  = buckets[(state.ref >> 6) + bucket];
+	const uint32_t frac   = uint64_t(scaled) >> 32;
+	const bool     keep   = frac < found.threshold;
+	state.drawn = keep ? found.symbol : found.alias;
+	state.next  = found.next[keep ? 0 : 1];
+	return state.drawn;
+}
+
+
+
+template <size_t SymCount, size_t SymBits>
+void TransitionAutomaton<SymCount, SymBits>::
+push(State& state, unsigned char sym) const
+{
+	state.ref   = sym == state.drawn ? state.next : restart[sym];
+	state.drawn = 255;
+}
+
+
+
+#endif
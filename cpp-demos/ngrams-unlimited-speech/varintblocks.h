@@ -0,0 +1,245 @@
+/*
+ * Table entries in sorted order coded as varints in independent blocks,
+ * see compressedFormat in Ngram::write.
+ */
+
+#ifndef VARINTBLOCKS_H
+#define VARINTBLOCKS_H
+
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+
+/// append value in 7 bit groups, lowest first, high bit set on all but the last byte
+inline void putVarint(std::vector<unsigned char>& dst, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		dst.push_back((unsigned char)(value | 0x80));
+		value >>= 7;
+	}
+	dst.push_back((unsigned char)value);
+}
+
+
+/// read a varint at src (advanced past it), false if it runs past end or does not fit 64 bits
+inline bool getVarint(const unsigned char*& src, const unsigned char* end, uint64_t& value)
+{
+	// most counts fit in one byte
+	if (src < end && *src < 0x80)
+	{
+		value = *src++;
+		return true;
+	}
+
+	value = 0;
+	for (unsigned int shift = 0; src < end && shift < 64; shift += 7)
+	{
+		const unsigned char byte = *src++;
+		if (shift == 63 && byte > 1)  // the 10th byte holds the top bit only, and ends the varint
+			return false;
+		value |= uint64_t(byte & 0x7f) << shift;
+		if (byte < 0x80)
+			return true;
+	}
+	return false;
+}
+
+
+
+/***
+ * Collects entries with ascending keys into a block and writes it as
+ *
+ * 1 uint32_t:  entry count
+ * 1 uint32_t:  byte length of the entries
+ * entries, each as varints: key difference to the previous entry (to 0
+ * for the first), successor mask, total count minus the sum of the
+ * successor counts, then the nonzero successor counts in symbol order.
+ *
+ * Blocks restart the key differences, so each decodes on its own.
+ */
+template <size_t SymCount>
+class BlockEncoder
+{
+public:
+	static const uint32_t blockEntries = 4096; ///< entries per full block
+
+	BlockEncoder() : entries(0), prevKey(0) { };
+
+	/// append an entry, key above the previous one, packed as for Ngram::visit
+	void add(uint64_t key, uint32_t mask, const uint64_t* packed)
+	{
+		putVarint(data, key - prevKey);
+		putVarint(data, mask);
+		uint64_t sum = 0;
+		const size_t count = __builtin_popcount(mask);
+		for (size_t idx = 1; idx <= count; ++idx)
+			sum += packed[idx];
+		putVarint(data, packed[0] - sum);
+		for (size_t idx = 1; idx <= count; ++idx)
+			putVarint(data, packed[idx]);
+		prevKey = key;
+		++entries;
+	};
+
+	bool     full() const { return entries >= blockEntries; };
+	uint32_t size() const { return entries; };
+
+	/// write the block and start a new one, nothing is written for an empty block
+	void write(std::ostream& os)
+	{
+		if (entries == 0)
+			return;
+		const uint32_t header[2] = {entries, uint32_t(data.size())};
+		os.write((char*)header, 2*4);
+		os.write((char*)data.data(), data.size());
+		restart();
+	};
+
+	/// as write(), appending the block to dst
+	void write(std::vector<unsigned char>& dst)
+	{
+		if (entries == 0)
+			return;
+		const uint32_t header[2] = {entries, uint32_t(data.size())};
+		dst.insert(dst.end(), (unsigned char*)header, (unsigned char*)(header+2));
+		dst.insert(dst.end(), data.begin(), data.end());
+		restart();
+	};
+
+private:
+	std::vector<unsigned char> data;
+	uint32_t                   entries;
+	uint64_t                   prevKey;
+
+	void restart()
+	{
+		data.clear();
+		entries = 0;
+		prevKey = 0;
+	};
+};
+
+
+
+/**
+ * Decode a block of entryCount entries held in src to src+length (as
+ * written by BlockEncoder, without the block header), calling
+ * visitor(key, mask, packed) for each. Returns false if the entries do not
+ * exactly fill the block.
+ */
+template <size_t SymCount, typename Visitor>
+bool decodeBlock(const unsigned char* src, size_t length, uint32_t entryCount, Visitor visitor)
+{
+	const unsigned char* end = src + length;
+	uint64_t key = 0;
+	uint64_t packed[SymCount+1];
+	for (uint32_t ii = 0; ii < entryCount; ++ii)
+	{
+		uint64_t delta, mask;
+		if (!getVarint(src, end, delta) || !getVarint(src, end, mask) || !getVarint(src, end, packed[0]) || (mask >> SymCount) != 0)
+			return false;
+		key += delta;
+		const size_t count = __builtin_popcount(uint32_t(mask));
+		for (size_t idx = 1; idx <= count; ++idx)
+		{
+			if (!getVarint(src, end, packed[idx]))
+				return false;
+			packed[0] += packed[idx];
+		}
+		visitor(key, uint32_t(mask), (const uint64_t*)packed);
+	}
+	return src == end;
+}
+
+
+
+/// a block held in memory by loadBlocks (or found by scanBlocks)
+struct BlockSpan
+{
+	uint64_t offset;   ///< of the entries in the loaded (or scanned) data
+	uint32_t length;   ///< bytes of the entries
+	uint32_t entries;  ///< entry count
+	uint64_t first;    ///< index of the first entry in the table
+};
+
+
+
+/**
+ * Read the blocks of entryCount entries from is into data without
+ * decoding them, for decoding on several threads. Returns false on a read
+ * error or bad block header.
+ */
+inline bool loadBlocks(std::istream& is, uint64_t entryCount, std::vector<unsigned char>& data, std::vector<BlockSpan>& blocks)
+{
+	for (uint64_t done = 0; done < entryCount; )
+	{
+		uint32_t header[2];
+		if (!is.read((char*)header, 2*4) || header[0] == 0 || header[0] > entryCount - done)
+			return false;
+		const BlockSpan block = {data.size(), header[1], header[0], done};
+		blocks.push_back(block);
+		data.resize(data.size() + header[1]);
+		if (!is.read((char*)&data[block.offset], block.length))
+			return false;
+		done += header[0];
+	}
+	return true;
+}
+
+
+
+/**
+ * Find the blocks of entryCount entries in the length bytes at data in
+ * place, without decoding them. Block offsets are relative to data.
+ * Returns false on a bad block header or a block running past the end.
+ */
+inline bool scanBlocks(const unsigned char* data, uint64_t length, uint64_t entryCount, std::vector<BlockSpan>& blocks)
+{
+	uint64_t pos = 0;
+	for (uint64_t done = 0; done < entryCount; )
+	{
+		uint32_t header[2];
+		if (length - pos < 2*4)
+			return false;
+		std::memcpy(header, data+pos, 2*4);
+		pos += 2*4;
+		if (header[0] == 0 || header[0] > entryCount - done || header[1] > length - pos)
+			return false;
+		const BlockSpan block = {pos, header[1], header[0], done};
+		blocks.push_back(block);
+		pos += header[1];
+		done += header[0];
+	}
+	return true;
+}
+
+
+
+/**
+ * Read blocks from is until entryCount entries have been decoded, calling
+ * visitor as decodeBlock does. Returns false on a read error or corrupt
+ * block.
+ */
+template <size_t SymCount, typename Visitor>
+bool readBlocks(std::istream& is, uint64_t entryCount, Visitor visitor)
+{
+	std::vector<unsigned char> data;
+	for (uint64_t done = 0; done < entryCount; )
+	{
+		uint32_t header[2];
+		if (!is.read((char*)header, 2*4) || header[0] == 0 || header[0] > entryCount - done)
+			return false;
+		data.resize(header[1]);
+		if (!is.read((char*)data.data(), data.size()) || !decodeBlock<SymCount>(data.data(), data.size(), header[0], visitor))
+			return false;
+		done += header[0];
+	}
+	return true;
+}
+
+
+
+#endif